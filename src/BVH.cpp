@@ -0,0 +1,261 @@
+#include "BVH.h"
+
+#include <algorithm>
+
+#include "Scene.h"
+
+// The number of buckets the object centroids are sorted into when evaluating the surface area heuristic
+#define BVH_BINS 16
+// The max number of objects in a leaf, larger leaves are split even if the heuristic would not
+#define BVH_MAX_LEAF 4
+// The depth past which we give up on the heuristic and split at the median object instead
+// so that the tree always fits within BVH_STACK_SIZE
+#define BVH_MAX_SAH_DEPTH 32
+// The cost of visiting a node relative to the cost of intersecting an object
+#define BVH_TRAVERSAL_COST 0.5
+// Object bounds are padded slightly so that hits on the very edge of a plane aren't culled
+#define BVH_BOUNDS_EPSILON 0.000001
+
+namespace raytrace {
+
+    struct bvhbounds {
+        double min[3];
+        double max[3];
+    };
+
+    // state shared by the recursive build
+    struct bvhbuilder {
+        bvhbounds *bounds;
+        double *centroids;
+        int32 *order;
+        bvhnode *nodes;
+        int32 node_count;
+    };
+
+    void resetBounds(bvhbounds *b) {
+        for (int i = 0; i < 3; i++) {
+            b->min[i] = 1e300;
+            b->max[i] = -1e300;
+        }
+    }
+
+    void growBounds(bvhbounds *b, bvhbounds *o) {
+        for (int i = 0; i < 3; i++) {
+            b->min[i] = o->min[i] < b->min[i] ? o->min[i] : b->min[i];
+            b->max[i] = o->max[i] > b->max[i] ? o->max[i] : b->max[i];
+        }
+    }
+
+    void growBounds(bvhbounds *b, double *point) {
+        for (int i = 0; i < 3; i++) {
+            b->min[i] = point[i] < b->min[i] ? point[i] : b->min[i];
+            b->max[i] = point[i] > b->max[i] ? point[i] : b->max[i];
+        }
+    }
+
+    double surfaceArea(bvhbounds *b) {
+        if (b->max[0] < b->min[0]) {
+            // empty bounds
+            return 0;
+        }
+        double dx = b->max[0] - b->min[0];
+        double dy = b->max[1] - b->min[1];
+        double dz = b->max[2] - b->min[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    int32 centroidBin(double centroid, double min, double extent) {
+        int32 bin = (int32) ((centroid - min) / extent * BVH_BINS);
+        return bin < BVH_BINS ? bin : BVH_BINS - 1;
+    }
+
+    // recursively builds the node for the objects in order[start, end) and returns its index
+    int32 buildNode(bvhbuilder *b, int32 start, int32 end, int32 depth) {
+        int32 index = b->node_count++;
+        bvhbounds node_bounds;
+        bvhbounds centroid_bounds;
+        resetBounds(&node_bounds);
+        resetBounds(&centroid_bounds);
+        for (int32 i = start; i < end; i++) {
+            growBounds(&node_bounds, &b->bounds[b->order[i]]);
+            growBounds(&centroid_bounds, &b->centroids[b->order[i] * 3]);
+        }
+        bvhnode *node = &b->nodes[index];
+        for (int i = 0; i < 3; i++) {
+            node->min[i] = node_bounds.min[i];
+            node->max[i] = node_bounds.max[i];
+        }
+        int32 count = end - start;
+
+        // evaluate the surface area heuristic for each bin boundary along each axis
+        // the cost of a split is the cost of visiting the node plus the cost of intersecting
+        // the objects of each child weighted by the chance a ray hitting this node also hits the child
+        int best_axis = -1;
+        int32 best_bin = 0;
+        double best_cost = count;
+        double parent_area = surfaceArea(&node_bounds);
+        if (count > 1 && depth < BVH_MAX_SAH_DEPTH && parent_area > 0) {
+            for (int axis = 0; axis < 3; axis++) {
+                double extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+                if (extent <= 0) {
+                    continue;
+                }
+                bvhbounds bins[BVH_BINS];
+                int32 bin_counts[BVH_BINS];
+                for (int i = 0; i < BVH_BINS; i++) {
+                    resetBounds(&bins[i]);
+                    bin_counts[i] = 0;
+                }
+                for (int32 i = start; i < end; i++) {
+                    int32 bin = centroidBin(b->centroids[b->order[i] * 3 + axis], centroid_bounds.min[axis], extent);
+                    growBounds(&bins[bin], &b->bounds[b->order[i]]);
+                    bin_counts[bin]++;
+                }
+                // sweep from the right to find the area and count of everything right of each boundary
+                double right_area[BVH_BINS];
+                int32 right_count[BVH_BINS];
+                bvhbounds sweep;
+                resetBounds(&sweep);
+                int32 sweep_count = 0;
+                for (int i = BVH_BINS - 1; i > 0; i--) {
+                    growBounds(&sweep, &bins[i]);
+                    sweep_count += bin_counts[i];
+                    right_area[i] = surfaceArea(&sweep);
+                    right_count[i] = sweep_count;
+                }
+                // then sweep from the left evaluating the cost of splitting at each boundary
+                resetBounds(&sweep);
+                sweep_count = 0;
+                for (int i = 1; i < BVH_BINS; i++) {
+                    growBounds(&sweep, &bins[i - 1]);
+                    sweep_count += bin_counts[i - 1];
+                    if (sweep_count == 0 || right_count[i] == 0) {
+                        continue;
+                    }
+                    double cost = BVH_TRAVERSAL_COST + (surfaceArea(&sweep) * sweep_count + right_area[i] * right_count[i]) / parent_area;
+                    if (cost < best_cost || (best_axis == -1 && count > BVH_MAX_LEAF)) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bin = i;
+                    }
+                }
+            }
+        }
+
+        int32 mid;
+        if (best_axis != -1) {
+            double min = centroid_bounds.min[best_axis];
+            double extent = centroid_bounds.max[best_axis] - min;
+            int32 *split = std::partition(b->order + start, b->order + end, [b, best_axis, best_bin, min, extent](int32 i) {
+                return centroidBin(b->centroids[i * 3 + best_axis], min, extent) < best_bin;
+            });
+            mid = (int32) (split - b->order);
+            node->splitting_axis = (Axis) best_axis;
+        } else if (count > BVH_MAX_LEAF) {
+            // either the tree is already too deep or all the centroids are in the same spot
+            // so we just split the objects in half along the largest axis
+            Axis axis = largestAxis(centroid_bounds.max[0] - centroid_bounds.min[0], centroid_bounds.max[1] - centroid_bounds.min[1], centroid_bounds.max[2] - centroid_bounds.min[2]);
+            mid = start + count / 2;
+            std::nth_element(b->order + start, b->order + mid, b->order + end, [b, axis](int32 l, int32 r) {
+                return b->centroids[l * 3 + axis] < b->centroids[r * 3 + axis];
+            });
+            node->splitting_axis = axis;
+        } else {
+            // intersecting the objects directly is cheaper than splitting
+            node->offset = start;
+            node->count = count;
+            node->splitting_axis = X_AXIS;
+            return index;
+        }
+
+        // the left child is always placed directly after its parent
+        node->count = 0;
+        buildNode(b, start, mid, depth + 1);
+        int32 right = buildNode(b, mid, end, depth + 1);
+        // the nodes array is never reallocated so our node pointer is still valid
+        node->offset = right;
+        return index;
+    }
+
+    BVH::BVH(SceneObject **scene_objects, int32 num_objects) {
+        size = 0;
+        objects = new SceneObject*[num_objects > 0 ? num_objects : 1];
+        for (int32 i = 0; i < num_objects; i++) {
+            if (scene_objects[i] != nullptr) {
+                objects[size++] = scene_objects[i];
+            }
+        }
+        node_count = 0;
+        nodes = new bvhnode[size > 0 ? 2 * size - 1 : 1];
+        if (size == 0) {
+            return;
+        }
+
+        bvhbuilder builder;
+        builder.bounds = new bvhbounds[size];
+        builder.centroids = new double[size * 3];
+        builder.order = new int32[size];
+        builder.nodes = nodes;
+        builder.node_count = 0;
+        Vec3 min(0, 0, 0);
+        Vec3 max(0, 0, 0);
+        for (int32 i = 0; i < size; i++) {
+            objects[i]->bounds(&min, &max);
+            bvhbounds *b = &builder.bounds[i];
+            b->min[0] = min.x - BVH_BOUNDS_EPSILON;
+            b->min[1] = min.y - BVH_BOUNDS_EPSILON;
+            b->min[2] = min.z - BVH_BOUNDS_EPSILON;
+            b->max[0] = max.x + BVH_BOUNDS_EPSILON;
+            b->max[1] = max.y + BVH_BOUNDS_EPSILON;
+            b->max[2] = max.z + BVH_BOUNDS_EPSILON;
+            for (int j = 0; j < 3; j++) {
+                builder.centroids[i * 3 + j] = (b->min[j] + b->max[j]) * 0.5;
+            }
+            builder.order[i] = i;
+        }
+        buildNode(&builder, 0, size, 0);
+        node_count = builder.node_count;
+
+        // reorder the objects to match the leaves
+        SceneObject **ordered = new SceneObject*[size];
+        for (int32 i = 0; i < size; i++) {
+            ordered[i] = objects[builder.order[i]];
+        }
+        delete[] objects;
+        objects = ordered;
+
+        delete[] builder.bounds;
+        delete[] builder.centroids;
+        delete[] builder.order;
+    }
+
+    BVH::~BVH() {
+        delete[] nodes;
+        delete[] objects;
+    }
+
+    // a slab test of the ray against the node's bounds, returns whether the ray enters the
+    // bounds before max_dist
+    bool intersectBounds(bvhnode *node, double *ray_source, double *inv_ray, double max_dist) {
+        double tmin = 0;
+        double tmax = max_dist;
+        for (int i = 0; i < 3; i++) {
+            double t0 = (node->min[i] - ray_source[i]) * inv_ray[i];
+            double t1 = (node->max[i] - ray_source[i]) * inv_ray[i];
+            if (t0 > t1) {
+                double t = t0;
+                t0 = t1;
+                t1 = t;
+            }
+            // written so that a NaN from a ray parallel to a slab leaves the interval unchanged
+            if (t0 > tmin) {
+                tmin = t0;
+            }
+            if (t1 < tmax) {
+                tmax = t1;
+            }
+        }
+        return tmin <= tmax;
+    }
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Vector.h"
+
+// The max depth of the hierarchy, and so the size of the stack needed to traverse it
+#define BVH_STACK_SIZE 64
+
+namespace raytrace {
+
+    class SceneObject;
+
+    // A node of the bounding volume hierarchy, the nodes are stored depth first so the
+    // left child of an interior node is always the node directly after it
+    struct bvhnode {
+        double min[3];
+        double max[3];
+        // the index of the right child for interior nodes or of the first object for leaves
+        int32 offset;
+        // the number of objects in a leaf, zero for interior nodes
+        int32 count;
+        Axis splitting_axis;
+    };
+
+    // A bounding volume hierarchy over the objects in a scene built using the surface area heuristic
+    class BVH {
+    public:
+        BVH(SceneObject **scene_objects, int32 num_objects);
+        ~BVH();
+
+        int32 node_count;
+        bvhnode *nodes;
+
+        // the scene objects reordered so that each leaf covers a contiguous range
+        int32 size;
+        SceneObject **objects;
+    };
+
+    bool intersectBounds(bvhnode *node, double *ray_source, double *inv_ray, double max_dist);
+
+}
@@ -11,10 +11,13 @@
 
 namespace raytrace {
 
-    void render(const char *image_file, int32 width, int32 height, int32 sample_ratio) {
-        // Seed the random engine with the current epoch tick
-        int64 time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        randutil::init(time);
+    void render(const char *image_file, int32 width, int32 height, render_settings *settings) {
+        // Seed the random engine with the given seed so the render can be reproduced, or the current epoch tick
+        int64 seed = settings->seed;
+        if (!settings->fixed_seed) {
+            seed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+        randutil::init(seed);
         printf("Setting up scene\n");
         // Setup our cornell box
         Scene *scene = new Scene(7);
@@ -28,31 +31,17 @@ namespace raytrace {
         scene->objects[6] = new SphereObject(-2, -3.5, 5, 1.5, 0xFFFFFFFF, 0.0, 1.0, 0.0, 0.0);
         // This is a smaller ball with some motion to test motion blur
         //scene->objects[7] = new SphereObject(0, 1, 5, 0.8, 0xFF33FF33, 0.4, 0.0, 0.0, 1.0, 0.2, 0, 0);
+        scene->build();
 
-        uint32 *pane = new uint32[width * height * sample_ratio * sample_ratio];
+        // the pane only holds the averaged color of each pixel so its size doesn't depend on the sample count
+        float *pane = new float[width * height * 3];
         Vec3 camera(0, 0, -12);
-        raytrace::renderScene(scene, camera, pane, width * sample_ratio, height * sample_ratio);
+        raytrace::renderScene(scene, camera, pane, width, height, settings);
 
         uint32 *sample = new uint32[width * height];
         for (int x = 0; x < width; x++) {
             for (int y = 0; y < height; y++) {
-                // each pixel is the averaged result of an n x n square of pixels in the pane
-                // the size of n is determined by the sample_ratio
-                int32 red = 0;
-                int32 green = 0;
-                int32 blue = 0;
-                for (int x0 = 0; x0 < sample_ratio; x0++) {
-                    for (int y0 = 0; y0 < sample_ratio; y0++) {
-                        int32 s = pane[x * sample_ratio + x0 + (y * sample_ratio + y0) * width * sample_ratio];
-                        red += (s >> 16) & 0xFF;
-                        green += (s >> 8) & 0xFF;
-                        blue += s & 0xFF;
-                    }
-                }
-                red /= sample_ratio * sample_ratio;
-                green /= sample_ratio * sample_ratio;
-                blue /= sample_ratio * sample_ratio;
-                sample[x + (height - y - 1) * width] = (0xFF << 24) | (red << 16) | (green << 8) | blue;
+                sample[x + (height - y - 1) * width] = paneColor(&pane[(x + y * width) * 3]);
             }
         }
 
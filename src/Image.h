@@ -2,9 +2,10 @@
 
 #include "Scene.h"
 #include "Vector.h"
+#include "Raytrace.h"
 
 namespace raytrace {
 
-    void render(const char *image_file, int32 width, int32 height, int32 samples);
+    void render(const char *image_file, int32 width, int32 height, render_settings *settings);
 
 }
\ No newline at end of file
@@ -1,77 +1,261 @@
-
 #include "JobSystem.h"
 
+#include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
-#define WINDOWS
-#include <windows.h>
-#include <direct.h>
-#include <io.h>
-#else
-#define LINUX
-#include <unistd.h>
-#endif
+// The starting capacity of each worker's deque, it grows if a worker submits more jobs than this
+#define DEQUE_CAPACITY 1024
+// The max number of jobs a worker moves from the shared queue to its own deque at once
+#define INJECT_BATCH 16
+// The number of times an idle worker looks for work before going to sleep
+#define IDLE_SPINS 64
 
 // This is a simple job system to parallelize certain tasks
+// Each worker has its own deque of jobs which it pushes to and pops from the bottom of while idle
+// workers steal from the top, jobs submitted from outside the workers go into a shared queue.
 namespace scheduler {
 
-    // a cross-platform sleep function with millisecond accuracy
-    void sleep(int milli) {
-#ifdef WINDOWS
-        Sleep(milli);
-#else
-        usleep(milli * 1000);
-#endif
+    // the ring buffer backing a deque
+    struct deque_buffer {
+        long long capacity;
+        std::atomic<Job*> *slots;
+        // buffers replaced by a larger one are kept until shutdown as a thief may still be reading them
+        deque_buffer *retired;
+    };
+
+    // A Chase-Lev work stealing deque
+    // based on "Correct and Efficient Work-Stealing for Weak Memory Models" by Le et al.
+    // https://www.di.ens.fr/~zappa/readings/ppopp13.pdf
+    // only the owning worker may push and pop, any thread may steal
+    struct work_deque {
+        std::atomic<long long> top;
+        std::atomic<long long> bottom;
+        std::atomic<deque_buffer*> buffer;
+    };
+
+    deque_buffer *createBuffer(long long capacity) {
+        deque_buffer *buf = new deque_buffer;
+        buf->capacity = capacity;
+        buf->slots = new std::atomic<Job*>[capacity];
+        buf->retired = nullptr;
+        return buf;
+    }
+
+    void push(work_deque *deque, Job *job) {
+        long long b = deque->bottom.load(std::memory_order_relaxed);
+        long long t = deque->top.load(std::memory_order_acquire);
+        deque_buffer *buf = deque->buffer.load(std::memory_order_relaxed);
+        if (b - t > buf->capacity - 1) {
+            // we're full so copy everything into a buffer twice the size
+            deque_buffer *grown = createBuffer(buf->capacity * 2);
+            for (long long i = t; i < b; i++) {
+                grown->slots[i & (grown->capacity - 1)].store(buf->slots[i & (buf->capacity - 1)].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            grown->retired = buf;
+            deque->buffer.store(grown, std::memory_order_release);
+            buf = grown;
+        }
+        buf->slots[b & (buf->capacity - 1)].store(job, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        deque->bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    Job *pop(work_deque *deque) {
+        long long b = deque->bottom.load(std::memory_order_relaxed) - 1;
+        deque_buffer *buf = deque->buffer.load(std::memory_order_relaxed);
+        deque->bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = deque->top.load(std::memory_order_relaxed);
+        Job *job = nullptr;
+        if (t <= b) {
+            job = buf->slots[b & (buf->capacity - 1)].load(std::memory_order_relaxed);
+            if (t == b) {
+                // this is the last job so we race any thieves for it
+                if (!deque->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    job = nullptr;
+                }
+                deque->bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            deque->bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    Job *steal(work_deque *deque) {
+        long long t = deque->top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = deque->bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        deque_buffer *buf = deque->buffer.load(std::memory_order_acquire);
+        Job *job = buf->slots[t & (buf->capacity - 1)].load(std::memory_order_relaxed);
+        if (!deque->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            // another thread took it first
+            return nullptr;
+        }
+        return job;
     }
 
     std::thread **threads;
     int thread_count;
-    bool running;
-    int finished = 0;
+    std::atomic<bool> running;
+    work_deque *deques;
+    // the index of the worker running on this thread, or -1 if this is not a worker thread
+    thread_local int worker_index = -1;
+
+    // jobs submitted from outside of the workers
     std::mutex job_mutex;
     Job *jobs_head;
     Job *jobs_tail;
+    // the number of jobs in the shared queue, lets workers check it without taking the lock
+    std::atomic<int> queued(0);
+
+    // the job records and the head of their free list, the head packs a counter that is bumped on
+    // every change into the upper 32 bits alongside the index of the first free record so that a
+    // compare and swap can't succeed on a head that was popped and pushed back in between
+    Job *job_pool;
+    std::atomic<unsigned long long> free_head;
 
-    void worker() {
+    Job *allocateJob() {
+        unsigned long long head = free_head.load(std::memory_order_acquire);
         while (true) {
-            Job *job = nullptr;
-            {
-                std::lock_guard<std::mutex> guard(job_mutex);
-                job = jobs_head;
-                Job *end = nullptr;
-                // Each worker pulls up to 10 tasks from the queue to lower the amount
-                // of time the mutex needs to be held for
-                for (int i = 0; i < 10; i++) {
-                    if (jobs_head != nullptr) {
-                        end = jobs_head;
-                        jobs_head = jobs_head->next_job;
-                        if (jobs_head == nullptr) {
-                            jobs_tail = nullptr;
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-                if (end != nullptr) {
-                    end->next_job = nullptr;
-                }
-                if (job == nullptr && !running) {
-                    // shutdown
-                    finished++;
-                    break;
-                }
+            int index = (int) (head & 0xFFFFFFFF);
+            if (index == -1) {
+                return nullptr;
             }
-            // execute the jobs
-            while (job != nullptr) {
-                job->job(job->job_data);
-                job = job->next_job;
+            unsigned long long next = (unsigned int) job_pool[index].next_free.load(std::memory_order_relaxed);
+            unsigned long long new_head = (((head >> 32) + 1) << 32) | next;
+            if (free_head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire)) {
+                return &job_pool[index];
             }
         }
     }
 
+    void freeJob(Job *job) {
+        unsigned long long index = (unsigned long long) (job - job_pool);
+        unsigned long long head = free_head.load(std::memory_order_relaxed);
+        while (true) {
+            job->next_free.store((int) (head & 0xFFFFFFFF), std::memory_order_relaxed);
+            unsigned long long new_head = (((head >> 32) + 1) << 32) | index;
+            if (free_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+    // idle workers sleep on this until more jobs are submitted
+    std::mutex idle_mutex;
+    std::condition_variable idle_condition;
+    std::atomic<int> sleeping(0);
+
+    // takes a job from the shared queue, a worker also moves a few more onto its own deque so
+    // that the other workers can steal them from it
+    Job *takeSubmitted(int index) {
+        std::lock_guard<std::mutex> guard(job_mutex);
+        Job *job = jobs_head;
+        if (job == nullptr) {
+            return nullptr;
+        }
+        jobs_head = job->next_job;
+        queued--;
+        for (int i = 1; i < INJECT_BATCH && index >= 0 && jobs_head != nullptr; i++) {
+            Job *next = jobs_head;
+            jobs_head = next->next_job;
+            queued--;
+            push(&deques[index], next);
+        }
+        if (jobs_head == nullptr) {
+            jobs_tail = nullptr;
+        }
+        return job;
+    }
+
+    // finds the next job for the given worker, first from its own deque, then from the shared
+    // queue, and finally by stealing from another worker
+    // threads which aren't workers have no deque and so only take from the shared queue or steal
+    Job *findJob(int index, unsigned int *victim_seed) {
+        Job *job = nullptr;
+        if (index >= 0) {
+            job = pop(&deques[index]);
+            if (job != nullptr) {
+                return job;
+            }
+        }
+        if (queued > 0) {
+            job = takeSubmitted(index);
+            if (job != nullptr) {
+                return job;
+            }
+        }
+        // start at a random victim so the thieves don't all pile onto the same worker
+        *victim_seed = *victim_seed * 1664525 + 1013904223;
+        int start = (int) ((*victim_seed >> 16) % thread_count);
+        for (int i = 0; i < thread_count; i++) {
+            int victim = (start + i) % thread_count;
+            if (victim == index) {
+                continue;
+            }
+            job = steal(&deques[victim]);
+            if (job != nullptr) {
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+    void execute(Job *job) {
+        JobGroup *group = job->group;
+        job->job(job->job_data);
+        freeJob(job);
+        int count = group->pending;
+        while (count > 1) {
+            if (group->pending.compare_exchange_weak(count, count - 1)) {
+                return;
+            }
+        }
+        // the last job of the group is only marked done while holding the lock so that a waiter
+        // can't miss the wake up, or return and free the group before we're done with it
+        std::lock_guard<std::mutex> guard(group->mutex);
+        if (--group->pending == 0) {
+            group->condition.notify_all();
+        }
+    }
+
+    void worker(int index) {
+        worker_index = index;
+        unsigned int victim_seed = (unsigned int) index + 1;
+        int idle = 0;
+        while (true) {
+            Job *job = findJob(index, &victim_seed);
+            if (job != nullptr) {
+                execute(job);
+                idle = 0;
+                continue;
+            }
+            if (!running) {
+                // shutdown
+                break;
+            }
+            if (++idle < IDLE_SPINS) {
+                std::this_thread::yield();
+                continue;
+            }
+            // sleep until a job is submitted, the timeout covers the small window where a
+            // job is pushed between our last search and us starting to wait
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            sleeping++;
+            idle_condition.wait_for(lock, std::chrono::milliseconds(1));
+            sleeping--;
+        }
+    }
+
     // starts `count` workers
     void startWorkers(int count) {
         printf("Starting jobs system with %d workers\n", count);
@@ -79,19 +263,49 @@ namespace scheduler {
         jobs_head = nullptr;
         jobs_tail = nullptr;
         running = true;
+        job_pool = new Job[JOB_POOL_SIZE];
+        for (int i = 0; i < JOB_POOL_SIZE; i++) {
+            job_pool[i].next_free = i + 1 < JOB_POOL_SIZE ? i + 1 : -1;
+        }
+        free_head = 0;
+        deques = new work_deque[count];
+        for (int i = 0; i < count; i++) {
+            deques[i].top = 0;
+            deques[i].bottom = 0;
+            deques[i].buffer = createBuffer(DEQUE_CAPACITY);
+        }
         threads = new std::thread*[count];
         for (int i = 0; i < count; i++) {
-            threads[i] = new std::thread(worker);
+            threads[i] = new std::thread(worker, i);
         }
     }
 
-    // inserts a job to the end of the job queue
-    void submit(task job, void *job_data) {
-        {
+    // submits a job as part of the given group, jobs submitted by a worker go onto its own
+    // deque without taking any lock while jobs from any other thread are added to the end of
+    // the shared queue
+    void submit(task job, const void *job_data, int size, JobGroup *group) {
+        Job *newjob = allocateJob();
+        if (newjob == nullptr) {
+            // every record is in use so help run jobs until one is freed
+            unsigned int victim_seed = (unsigned int) worker_index + 13;
+            while ((newjob = allocateJob()) == nullptr) {
+                Job *next = findJob(worker_index, &victim_seed);
+                if (next != nullptr) {
+                    execute(next);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        memcpy(newjob->job_data, job_data, size);
+        newjob->job = job;
+        newjob->group = group;
+        newjob->next_job = nullptr;
+        group->pending++;
+        if (worker_index >= 0) {
+            push(&deques[worker_index], newjob);
+        } else {
             std::lock_guard<std::mutex> guard(job_mutex);
-
-            Job *newjob = new Job(job_data, job);
-
             if (jobs_head == nullptr) {
                 jobs_head = newjob;
                 jobs_tail = newjob;
@@ -99,28 +313,59 @@ namespace scheduler {
                 jobs_tail->next_job = newjob;
                 jobs_tail = newjob;
             }
-
+            queued++;
         }
+        if (sleeping > 0) {
+            idle_condition.notify_one();
+        }
+    }
 
+    // waits until every job in the group has completed
+    // the waiting thread runs jobs itself while it waits and only sleeps once there are none
+    // left for it to take, the group may be reused for another phase afterwards
+    void wait(JobGroup *group) {
+        unsigned int victim_seed = (unsigned int) worker_index + 7;
+        while (group->pending > 0) {
+            Job *job = findJob(worker_index, &victim_seed);
+            if (job != nullptr) {
+                execute(job);
+                continue;
+            }
+            // the rest of the group's jobs are running on other threads
+            std::unique_lock<std::mutex> lock(group->mutex);
+            group->condition.wait(lock, [group] {
+                return group->pending == 0;
+            });
+        }
+        // wait for the thread that finished the last job to release the group
+        std::lock_guard<std::mutex> guard(group->mutex);
     }
 
-    // waits until all jobs have been completed
-    // also shuts down the scheduler allowing the worker threads to exit
-    void waitForCompletion() {
+    // shuts down the scheduler once the workers have run every remaining job
+    void stopWorkers() {
         running = false;
-        while (true) {
-            if (jobs_head == nullptr && finished == thread_count) {
-                break;
-            } else {
-                sleep(1);
+        idle_condition.notify_all();
+        for (int i = 0; i < thread_count; i++) {
+            threads[i]->join();
+            delete threads[i];
+        }
+        delete[] threads;
+        for (int i = 0; i < thread_count; i++) {
+            deque_buffer *buf = deques[i].buffer;
+            while (buf != nullptr) {
+                deque_buffer *retired = buf->retired;
+                delete[] buf->slots;
+                delete buf;
+                buf = retired;
             }
         }
+        delete[] deques;
+        delete[] job_pool;
+        thread_count = 0;
     }
 
-    Job::Job(void *data, task t) {
-        job_data = data;
-        job = t;
-        next_job = nullptr;
+    JobGroup::JobGroup() {
+        pending = 0;
     }
 
-}
\ No newline at end of file
+}
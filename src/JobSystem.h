@@ -1,21 +1,58 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+
+// The max size of the data passed to a job, anything larger should be shared through a pointer
+#define JOB_DATA_SIZE 48
+// The number of job records in the pool, submitting more jobs than this at once
+// waits for some of them to be finished
+#define JOB_POOL_SIZE 16384
+
 namespace scheduler {
 
     typedef void(*task)(void*);
-    class Job {
+
+    // A counter of the outstanding jobs in one parallel phase which can be waited on
+    // without waiting for every other job in the scheduler
+    class JobGroup {
     public:
-        Job(void *job_data, task job);
+        JobGroup();
+
+        std::atomic<int> pending;
 
-        void *job_data;
+        // a waiting thread sleeps on this once it can't find any jobs to help with
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+
+    // A job record, these come from a fixed pool so that submitting a job never allocates
+    class Job {
+    public:
+        // a copy of the data passed to submit which the job receives a pointer to
+        alignas(16) char job_data[JOB_DATA_SIZE];
         task job;
+        JobGroup *group;
 
         Job *next_job;
+        // the index of the next record in the pool's free list
+        std::atomic<int> next_free;
 
     };
 
     void startWorkers(int count);
-    void submit(task job, void *job_data);
-    void waitForCompletion();
+    void submit(task job, const void *job_data, int size, JobGroup *group);
+    void wait(JobGroup *group);
+    void stopWorkers();
+
+    // submits a job whose data is copied into the job record
+    template <typename T>
+    void submit(task job, const T &job_data, JobGroup *group) {
+        static_assert(sizeof(T) <= JOB_DATA_SIZE, "job data is too large to store in the job");
+        static_assert(std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value, "job data must be a plain struct");
+        submit(job, &job_data, (int) sizeof(T), group);
+    }
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #define OUTPUT_IMAGE
 
@@ -12,8 +13,19 @@
 #include "JobSystem.h"
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        printf("Usage: ./raytracer [# cores] [width] [height] [samples]\n");
+    if (argc < 5) {
+        printf("Usage: ./raytracer [# cores] [width] [height] [samples] [options]\n");
+        printf("Options:\n");
+        printf("  -k [n]        the number of photons in each global estimate\n");
+        printf("  -ck [n]       the number of photons in each caustic estimate\n");
+        printf("  -irradiance   precompute the irradiance of the global photon map\n");
+        printf("  -grid         search the global photon map with a hash grid instead of a kd-tree\n");
+        printf("  -cgrid        search the caustic photon map with a hash grid instead of a kd-tree\n");
+        printf("  -sppm [n]     render with n passes of progressive photon mapping\n");
+        printf("  -sppm-photons [n] the number of photons traced in each progressive pass\n");
+        printf("  -cache [dir]  load the photon maps from dir if this scene was rendered before, or save them there\n");
+        printf("  -seed [n]     seed the random numbers with n so the same render gives the same image\n");
+        printf("  -coarse [n]   estimate the global light from kd-tree nodes instead of gathering at n bounces or more, n is at least 1\n");
         return 0;
     }
     int cores = atoi(argv[1]);
@@ -27,15 +39,61 @@ int main(int argc, char *argv[]) {
         printf("Image dimensions must be a 16:9 ratio.\n");
         return 0;
     }
-    if (samples < 0 || width < 0 || height < 0) {
+    if (samples < 1 || width < 0 || height < 0) {
         printf("Dimensions and samples must be positive\n");
         return 0;
     }
+#ifdef OUTPUT_IMAGE
+    raytrace::render_settings settings;
+    raytrace::defaultSettings(&settings);
+    settings.samples = samples;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            settings.photons_in_estimate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-ck") == 0 && i + 1 < argc) {
+            settings.caustic_photons_in_estimate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-irradiance") == 0) {
+            settings.precompute_irradiance = true;
+        } else if (strcmp(argv[i], "-grid") == 0) {
+            settings.global_backend = raytrace::HASH_GRID_BACKEND;
+        } else if (strcmp(argv[i], "-cgrid") == 0) {
+            settings.caustic_backend = raytrace::HASH_GRID_BACKEND;
+        } else if (strcmp(argv[i], "-sppm") == 0 && i + 1 < argc) {
+            settings.progressive_passes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-sppm-photons") == 0 && i + 1 < argc) {
+            settings.photons_per_pass = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            settings.photon_cache = argv[++i];
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            settings.fixed_seed = true;
+            settings.seed = strtoll(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-coarse") == 0 && i + 1 < argc) {
+            settings.coarse_bounce = atoi(argv[++i]);
+            // primary hits always gather the photons exactly, and a bad number parses as 0
+            if (settings.coarse_bounce < 1) {
+                printf("The coarse bounce must be at least 1\n");
+                return 0;
+            }
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return 0;
+        }
+    }
+    if (settings.photons_in_estimate < 1 || settings.caustic_photons_in_estimate < 1) {
+        printf("The photons in each estimate must be positive\n");
+        return 0;
+    }
+    if (settings.progressive_passes < 0 || settings.photons_per_pass < 1) {
+        printf("The progressive passes and photons per pass must be positive\n");
+        return 0;
+    }
+#endif
     scheduler::startWorkers(cores);
 #ifdef OUTPUT_IMAGE
-    raytrace::render("raytraced.png", width, height, samples);
+    raytrace::render("raytraced.png", width, height, &settings);
 #else
     raytrace::run();
 #endif
+    scheduler::stopWorkers();
     return 0;
 }
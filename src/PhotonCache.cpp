@@ -0,0 +1,357 @@
+#include "PhotonCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "PhotonGrid.h"
+
+// Marks a file as a photon map cache, "RSPM"
+#define CACHE_MAGIC 0x4D505352
+// Bump whenever the photon tracing or the layout of the indexes changes so old caches are ignored
+#define CACHE_VERSION 8
+// Each array in the file starts on its own page, so the pages a gather faults in hold nothing but
+// the parts of the arrays it reads
+#define CACHE_ALIGNMENT 4096
+// The number of arrays stored for each index
+#define CACHE_ARRAYS 5
+
+namespace raytrace {
+
+    // The start of a cache file
+    struct cache_header {
+        uint32 magic;
+        uint32 version;
+        uint64 key;
+        int32 backend;
+        // the number of indexes, one for each object in the scene
+        int32 count;
+    };
+
+    // Describes the index of a single object in a cache file
+    struct cache_entry {
+        int32 size;
+        // the depth of a kd-tree
+        int32 depth;
+        // the table mask and cell size of a hash grid
+        uint32 table_mask;
+        // whether a kd-tree's aggregates were stored
+        int32 aggregated;
+        double cell_size;
+        // the offset of each of the index's arrays from the start of the file
+        uint64 offsets[CACHE_ARRAYS];
+    };
+
+    mapped_file *openMappedFile(const char *path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            CloseHandle(file);
+            return nullptr;
+        }
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) {
+            CloseHandle(file);
+            return nullptr;
+        }
+        void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data == nullptr) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return nullptr;
+        }
+        mapped_file *result = new mapped_file;
+        result->data = data;
+        result->size = (uint64) size.QuadPart;
+        result->file = file;
+        result->mapping = mapping;
+        return result;
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+        void *data = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping keeps the file alive on its own
+        close(fd);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+        // gathers read the photons in small scattered pieces so reading ahead of each fault would only
+        // pull in pages nothing asked for
+        madvise(data, (size_t) info.st_size, MADV_RANDOM);
+        mapped_file *result = new mapped_file;
+        result->data = data;
+        result->size = (uint64) info.st_size;
+        return result;
+#endif
+    }
+
+    void closeMappedFile(mapped_file *file) {
+#ifdef _WIN32
+        UnmapViewOfFile(file->data);
+        CloseHandle((HANDLE) file->mapping);
+        CloseHandle((HANDLE) file->file);
+#else
+        munmap(file->data, (size_t) file->size);
+#endif
+        delete file;
+    }
+
+    uint64 photonMapKey(Scene *scene, bool caustic, int32 global_count, int32 caustic_count, Vec3 &light_color, PhotonBackend backend, int32 k, bool aggregated, bool fixed_seed, int64 seed) {
+        uint64 key = scene->hash();
+        int32 layout[6] = { CACHE_VERSION, (int32) sizeof(photon), KD_BUCKET_SIZE, caustic ? 1 : 0, global_count, caustic_count };
+        double light[7] = { LIGHT_X, LIGHT_Y, LIGHT_Z, LIGHT_SIZE, light_color.x, light_color.y, light_color.z };
+        key = hashBytes(key, layout, sizeof(layout));
+        key = hashBytes(key, light, sizeof(light));
+        // photons traced from the clock are as good as any others, but a seeded render has to trace its own
+        int64 seeding[2] = { fixed_seed ? 1 : 0, fixed_seed ? seed : 0 };
+        key = hashBytes(key, seeding, sizeof(seeding));
+        // k only sizes the hash grid cells so kd-trees are shared by every k
+        int32 index[3] = { (int32) backend, backend == HASH_GRID_BACKEND ? k : 0, aggregated ? 1 : 0 };
+        return hashBytes(key, index, sizeof(index));
+    }
+
+    void cachePath(char *path, int32 length, const char *directory, uint64 key) {
+        snprintf(path, length, "%s/photons-%016llx.bin", directory, key);
+    }
+
+    // the sizes in bytes of each array of the index an entry describes
+    // the photons and their positions are in the order of the kd-tree's buckets, so the photons near
+    // each other in space are near each other in the file and a gather only touches a few pages
+    // a grid keeps whole photons while a kd-tree keeps their payloads and positions apart
+    void arraySizes(cache_entry *entry, PhotonBackend backend, uint64 *sizes) {
+        if (backend == HASH_GRID_BACKEND) {
+            sizes[0] = (uint64) entry->size * sizeof(photon);
+            sizes[1] = ((uint64) entry->table_mask + 2) * sizeof(int32);
+            sizes[2] = 0;
+            sizes[3] = 0;
+            sizes[4] = 0;
+        } else {
+            uint64 bucket_count = (uint64) 1 << entry->depth;
+            sizes[0] = (uint64) entry->size * sizeof(photon_payload);
+            sizes[1] = bucket_count * sizeof(kdsplit);
+            sizes[2] = (bucket_count + 1) * sizeof(int32);
+            sizes[3] = ((uint64) entry->size * 3 + KD_BUCKET_SIZE) * sizeof(float);
+            // the aggregates are stored rather than summed on load, which would read every photon
+            sizes[4] = entry->aggregated ? (bucket_count - 1) * sizeof(kdaggregate) : 0;
+        }
+    }
+
+    // the arrays of an index in the order they're written to the file
+    void indexArrays(PhotonIndex *index, PhotonBackend backend, void **arrays) {
+        if (backend == HASH_GRID_BACKEND) {
+            arrays[0] = ((HashGrid*) index)->photons;
+            arrays[1] = ((HashGrid*) index)->slots;
+            arrays[2] = nullptr;
+            arrays[3] = nullptr;
+            arrays[4] = nullptr;
+        } else {
+            KDTree *tree = (KDTree*) index;
+            arrays[0] = tree->payloads;
+            arrays[1] = tree->splits;
+            arrays[2] = tree->buckets;
+            arrays[3] = tree->positions;
+            arrays[4] = tree->aggregates;
+        }
+    }
+
+    uint64 alignOffset(uint64 offset) {
+        return (offset + CACHE_ALIGNMENT - 1) & ~(uint64) (CACHE_ALIGNMENT - 1);
+    }
+
+    photon_map *loadPhotonMap(const char *directory, uint64 key, Scene *scene, PhotonBackend backend) {
+        char path[1024];
+        cachePath(path, sizeof(path), directory, key);
+        mapped_file *file = openMappedFile(path);
+        if (file == nullptr) {
+            return nullptr;
+        }
+        uint8 *data = (uint8*) file->data;
+        cache_header *header = (cache_header*) data;
+        uint64 table_end = sizeof(cache_header) + (uint64) scene->size * sizeof(cache_entry);
+        if (file->size < sizeof(cache_header) || header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->key != key ||
+                header->backend != backend || header->count != scene->size || file->size < table_end) {
+            closeMappedFile(file);
+            return nullptr;
+        }
+        cache_entry *entries = (cache_entry*) (data + sizeof(cache_header));
+        // check that every array lies within the file before building anything on top of it
+        for (int32 i = 0; i < header->count; i++) {
+            cache_entry *entry = &entries[i];
+            if (entry->size < 0 || entry->depth < 0 || entry->depth > 30 || (entry->aggregated != 0 && entry->aggregated != 1)) {
+                closeMappedFile(file);
+                return nullptr;
+            }
+            uint64 sizes[CACHE_ARRAYS];
+            arraySizes(entry, backend, sizes);
+            for (int j = 0; j < CACHE_ARRAYS; j++) {
+                if (entry->offsets[j] % CACHE_ALIGNMENT != 0 || entry->offsets[j] > file->size || sizes[j] > file->size - entry->offsets[j]) {
+                    closeMappedFile(file);
+                    return nullptr;
+                }
+            }
+        }
+        // nothing was traced so the direction tables still need filling
+        initPhotonTables();
+        photon_map *map = new photon_map;
+        map->count = header->count;
+        map->irradiance = nullptr;
+        map->backend = backend;
+        map->file = file;
+        map->indexes = new PhotonIndex*[map->count];
+        for (int32 i = 0; i < map->count; i++) {
+            cache_entry *entry = &entries[i];
+            if (backend == HASH_GRID_BACKEND) {
+                map->indexes[i] = new HashGrid((photon*) (data + entry->offsets[0]), entry->size, entry->cell_size, entry->table_mask, (int32*) (data + entry->offsets[1]));
+            } else {
+                map->indexes[i] = new KDTree((photon_payload*) (data + entry->offsets[0]), entry->size, entry->depth, (kdsplit*) (data + entry->offsets[1]),
+                    (int32*) (data + entry->offsets[2]), (float*) (data + entry->offsets[3]),
+                    entry->aggregated ? (kdaggregate*) (data + entry->offsets[4]) : nullptr);
+            }
+        }
+        return map;
+    }
+
+    void savePhotonMap(const char *directory, uint64 key, photon_map *map) {
+        char path[1024];
+        char temp_path[1100];
+        cachePath(path, sizeof(path), directory, key);
+        // write to a file of our own and move it into place once it's complete so that other renders
+        // sharing the cache never map a partial file
+#ifdef _WIN32
+        snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, _getpid());
+#else
+        snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int) getpid());
+#endif
+        FILE *out = fopen(temp_path, "wb");
+        if (out == nullptr) {
+            printf("Couldn't write photon map cache %s\n", temp_path);
+            return;
+        }
+        cache_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = CACHE_MAGIC;
+        header.version = CACHE_VERSION;
+        header.key = key;
+        header.backend = map->backend;
+        header.count = map->count;
+        // lay out the arrays of every index after the table of entries
+        cache_entry *entries = new cache_entry[map->count > 0 ? map->count : 1];
+        uint64 offset = sizeof(cache_header) + (uint64) map->count * sizeof(cache_entry);
+        for (int32 i = 0; i < map->count; i++) {
+            PhotonIndex *index = map->indexes[i];
+            cache_entry *entry = &entries[i];
+            memset(entry, 0, sizeof(cache_entry));
+            entry->size = index->size;
+            if (map->backend == HASH_GRID_BACKEND) {
+                entry->table_mask = ((HashGrid*) index)->table_mask;
+                entry->cell_size = ((HashGrid*) index)->cell_size;
+            } else {
+                entry->depth = ((KDTree*) index)->depth;
+                entry->aggregated = ((KDTree*) index)->aggregates != nullptr ? 1 : 0;
+            }
+            uint64 sizes[CACHE_ARRAYS];
+            arraySizes(entry, map->backend, sizes);
+            for (int j = 0; j < CACHE_ARRAYS; j++) {
+                offset = alignOffset(offset);
+                entry->offsets[j] = offset;
+                offset += sizes[j];
+            }
+        }
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+        if (map->count > 0) {
+            written = written && fwrite(entries, sizeof(cache_entry), map->count, out) == (size_t) map->count;
+        }
+        uint64 position = sizeof(cache_header) + (uint64) map->count * sizeof(cache_entry);
+        static const uint8 padding[CACHE_ALIGNMENT] = { 0 };
+        for (int32 i = 0; i < map->count && written; i++) {
+            void *arrays[CACHE_ARRAYS];
+            uint64 sizes[CACHE_ARRAYS];
+            indexArrays(map->indexes[i], map->backend, arrays);
+            arraySizes(&entries[i], map->backend, sizes);
+            for (int j = 0; j < CACHE_ARRAYS && written; j++) {
+                uint64 pad = entries[i].offsets[j] - position;
+                if (pad > 0) {
+                    written = fwrite(padding, 1, (size_t) pad, out) == pad;
+                }
+                if (sizes[j] > 0) {
+                    written = written && fwrite(arrays[j], 1, (size_t) sizes[j], out) == sizes[j];
+                }
+                position = entries[i].offsets[j] + sizes[j];
+            }
+        }
+        written = fclose(out) == 0 && written;
+        delete[] entries;
+        if (!written) {
+            printf("Couldn't write photon map cache %s\n", temp_path);
+            remove(temp_path);
+            return;
+        }
+        // another render may have finished the same map first, theirs is identical so ours can go
+        if (rename(temp_path, path) != 0) {
+            remove(temp_path);
+        }
+    }
+
+    // replaces a photon map with the one just saved to the cache, keeping it if it couldn't be saved
+    void reloadPhotonMap(const char *directory, uint64 key, Scene *scene, PhotonBackend backend, photon_map **map) {
+        photon_map *mapped = loadPhotonMap(directory, key, scene, backend);
+        if (mapped != nullptr) {
+            deletePhotonMap(*map);
+            *map = mapped;
+        }
+    }
+
+    void cachedPhotonMaps(const char *directory, int32 global_count, int32 caustic_count, Vec3 &light_color, Scene *scene, photon_map_options *options, bool fixed_seed, int64 seed, photon_map **global_map, photon_map **caustic_map) {
+        if (directory == nullptr) {
+            createPhotonMaps(global_count, caustic_count, light_color, scene, options, 0, global_map, caustic_map);
+            return;
+        }
+        uint64 global_key = photonMapKey(scene, false, global_count, caustic_count, light_color, options->global_backend, options->global_k, options->global_aggregates, fixed_seed, seed);
+        uint64 caustic_key = photonMapKey(scene, true, global_count, caustic_count, light_color, options->caustic_backend, options->caustic_k, false, fixed_seed, seed);
+        auto start = std::chrono::high_resolution_clock::now();
+        *global_map = loadPhotonMap(directory, global_key, scene, options->global_backend);
+        *caustic_map = loadPhotonMap(directory, caustic_key, scene, options->caustic_backend);
+        if (*global_map != nullptr && *caustic_map != nullptr) {
+            std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+            printf("Loaded photon maps %016llx and %016llx from the cache in %.3fs\n", global_key, caustic_key, duration.count());
+            return;
+        }
+        // both maps come from the same pass so if either is missing we trace them both again
+        if (*global_map != nullptr) {
+            deletePhotonMap(*global_map);
+        }
+        if (*caustic_map != nullptr) {
+            deletePhotonMap(*caustic_map);
+        }
+        createPhotonMaps(global_count, caustic_count, light_color, scene, options, 0, global_map, caustic_map);
+        savePhotonMap(directory, global_key, *global_map);
+        savePhotonMap(directory, caustic_key, *caustic_map);
+        // render from the saved files rather than the copies in memory, so only the pages the gathers
+        // touch are resident and the OS can drop them again if memory runs short
+        reloadPhotonMap(directory, global_key, scene, options->global_backend, global_map);
+        reloadPhotonMap(directory, caustic_key, scene, options->caustic_backend, caustic_map);
+    }
+
+}
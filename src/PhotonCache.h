@@ -0,0 +1,41 @@
+#pragma once
+
+#include "Vector.h"
+#include "Scene.h"
+#include "PhotonMap.h"
+
+namespace raytrace {
+
+    // A read only file mapped into memory
+    struct mapped_file {
+        void *data;
+        uint64 size;
+#ifdef _WIN32
+        void *file;
+        void *mapping;
+#endif
+    };
+
+    mapped_file *openMappedFile(const char *path);
+    void closeMappedFile(mapped_file *file);
+
+    // the key of a photon map in the cache, made from the scene's contents and everything else the
+    // photons and their indexes depend on
+    // both maps come from the same photons so the key holds both of their counts
+    // maps with aggregates are kept apart from the ones without so a coarse render always has them
+    // a fixed seed is part of the key so the same seed always renders the same image
+    uint64 photonMapKey(Scene *scene, bool caustic, int32 global_count, int32 caustic_count, Vec3 &light_color, PhotonBackend backend, int32 k, bool aggregated, bool fixed_seed, int64 seed);
+
+    // loads the photon map with the key from the cache directory, or returns null if it isn't there
+    // the indexes point straight into the mapped file so nothing is traced or built
+    photon_map *loadPhotonMap(const char *directory, uint64 key, Scene *scene, PhotonBackend backend);
+    // writes the photon map to the cache directory so later renders of the same scene can load it
+    void savePhotonMap(const char *directory, uint64 key, photon_map *map);
+
+    // loads the global and caustic photon maps from the cache directory, tracing and saving them if
+    // they aren't there yet, a null directory always traces the photons
+    // maps from the cache are always rendered from the mapped files, so photon maps larger than memory
+    // only need the pages gathers touch to be resident
+    void cachedPhotonMaps(const char *directory, int32 global_count, int32 caustic_count, Vec3 &light_color, Scene *scene, photon_map_options *options, bool fixed_seed, int64 seed, photon_map **global_map, photon_map **caustic_map);
+
+}
@@ -0,0 +1,113 @@
+#include "PhotonGrid.h"
+
+#include <cmath>
+
+namespace raytrace {
+
+    uint32 hashCell(int32 x, int32 y, int32 z) {
+        // from "Optimized Spatial Hashing for Collision Detection of Deformable Objects" by Teschner et al.
+        return ((uint32) x * 73856093u) ^ ((uint32) y * 19349663u) ^ ((uint32) z * 83492791u);
+    }
+
+    int32 gridCoord(double value, double cell_size) {
+        return (int32) floor(value / cell_size);
+    }
+
+    // builds the grid by counting the photons in each slot and then placing them in one pass
+    HashGrid::HashGrid(photon *source, int32 count, double radius) {
+        size = count;
+        owned = true;
+        cell_size = radius;
+        uint32 table_size = 1;
+        while (table_size < (uint32) count * 2) {
+            table_size *= 2;
+        }
+        table_mask = table_size - 1;
+        photons = new photon[count > 0 ? count : 1];
+        slots = new int32[table_size + 1];
+        uint32 *hashes = new uint32[count > 0 ? count : 1];
+        for (uint32 i = 0; i <= table_size; i++) {
+            slots[i] = 0;
+        }
+        for (int32 i = 0; i < count; i++) {
+            photon *p = &source[i];
+            hashes[i] = hashCell(gridCoord(p->x, cell_size), gridCoord(p->y, cell_size), gridCoord(p->z, cell_size)) & table_mask;
+            slots[hashes[i] + 1]++;
+        }
+        for (uint32 i = 0; i < table_size; i++) {
+            slots[i + 1] += slots[i];
+        }
+        int32 *next = new int32[table_size];
+        for (uint32 i = 0; i < table_size; i++) {
+            next[i] = slots[i];
+        }
+        for (int32 i = 0; i < count; i++) {
+            photons[next[hashes[i]]++] = source[i];
+        }
+        delete[] next;
+        delete[] hashes;
+    }
+
+    HashGrid::HashGrid(photon *photons0, int32 count, double radius, uint32 table_mask0, int32 *slots0) {
+        photons = photons0;
+        size = count;
+        owned = false;
+        cell_size = radius;
+        table_mask = table_mask0;
+        slots = slots0;
+    }
+
+    HashGrid::~HashGrid() {
+        if (owned) {
+            delete[] photons;
+            delete[] slots;
+        }
+    }
+
+    int HashGrid::findNearest(photon_gather *gather, Vec3 *target, double max_dist) {
+        double limit = cell_size * cell_size < max_dist ? cell_size * cell_size : max_dist;
+        int32 cx = gridCoord(target->x, cell_size);
+        int32 cy = gridCoord(target->y, cell_size);
+        int32 cz = gridCoord(target->z, cell_size);
+        // different cells can hash to the same slot so we remember which we've searched
+        uint32 searched[27];
+        int32 searched_count = 0;
+        for (int32 x = cx - 1; x <= cx + 1; x++) {
+            for (int32 y = cy - 1; y <= cy + 1; y++) {
+                for (int32 z = cz - 1; z <= cz + 1; z++) {
+                    uint32 slot = hashCell(x, y, z) & table_mask;
+                    bool repeat = false;
+                    for (int32 i = 0; i < searched_count; i++) {
+                        if (searched[i] == slot) {
+                            repeat = true;
+                            break;
+                        }
+                    }
+                    if (repeat) {
+                        continue;
+                    }
+                    searched[searched_count++] = slot;
+                    for (int32 i = slots[slot]; i < slots[slot + 1]; i++) {
+                        photon *p = &photons[i];
+                        double dx = p->x - target->x;
+                        double dy = p->y - target->y;
+                        double dz = p->z - target->z;
+                        double dist = dx * dx + dy * dy + dz * dz;
+                        if (dist < limit) {
+                            gatherPhoton(gather, &p->payload, dist);
+                            if (gather->size == gather->k) {
+                                limit = gatherRadius(gather);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return gather->size;
+    }
+
+    void HashGrid::getPhoton(int32 i, photon *result) {
+        *result = photons[i];
+    }
+
+}
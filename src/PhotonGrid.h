@@ -0,0 +1,29 @@
+#pragma once
+
+#include "PhotonMap.h"
+
+namespace raytrace {
+
+    // A uniform grid of photons hashed into a table, each cell is as wide as the gather radius
+    // so a gather only has to search the 27 cells around the target
+    // gathers never return photons farther away than the cell size
+    class HashGrid : public PhotonIndex {
+    public:
+        HashGrid(photon *source, int32 count, double radius);
+        // wraps a grid that was already built without taking ownership of its arrays
+        HashGrid(photon *photons, int32 count, double radius, uint32 table_mask, int32 *slots);
+        ~HashGrid();
+
+        int findNearest(photon_gather *gather, Vec3 *target, double max_dist) override;
+        void getPhoton(int32 i, photon *result) override;
+
+        // the photons in slot order
+        photon *photons;
+        double cell_size;
+        // the table size is a power of two so this masks a hash to a slot
+        uint32 table_mask;
+        // the index of the first photon of each slot, plus one past the end
+        int32 *slots;
+    };
+
+}
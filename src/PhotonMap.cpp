@@ -4,511 +4,1395 @@
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <algorithm>
 
 #include "Random.h"
+#include "JobSystem.h"
+#include "PhotonGrid.h"
+#include "PhotonCache.h"
+
+// The number of photons traced by each photon tracing job
+#define PHOTONS_PER_JOB 1024
+// Subtrees of the kd-tree with at least this many photons are built as separate jobs
+#define KDTREE_JOB_SIZE 8192
+// The largest k gathered into a sorted array, anything larger uses a heap
+#define GATHER_SORTED_SIZE 16
+// The max depth of the kd-tree, and so the size of the stack needed to search it
+#define KD_STACK_SIZE 32
+// Irradiance is precomputed at one in this many photons
+#define IRRADIANCE_STRIDE 4
+// The number of irradiance estimates computed by each precompute job
+#define IRRADIANCE_PER_JOB 256
+// Hash grid cells are made this much larger than the radius expected to hold k photons
+#define GRID_RADIUS_SCALE 1.5
+#define GRID_MIN_RADIUS 0.001
+// The cone filter in estimateIrradiance averages to a third over the gather area, which it also
+// divides by twice, so a coarse estimate over the same area is scaled down by this
+#define COARSE_FILTER_SCALE 6
+// A coarse estimate is only made if no photon could arrive from further behind the surface than this
+// cosine, allowing for the quantized photon directions at grazing angles
+#define COARSE_MAX_FACING 0.02
+// The bound taken from the last gather is grown slightly so the kd-tree's float distances can't round past it
+#define GATHER_CACHE_MARGIN 1.001
+// The number of cells along each side of the caustic projection map
+#define PROJECTION_RESOLUTION 64
+// The light is split into this many patches along each side, each with its own projection map
+#define PROJECTION_PATCHES 8
+// A job stops emitting through the projection map once it has emitted this many photons for each
+// caustic they made, so marked cells which never make a caustic can't keep it going forever
+#define PROJECTION_MAX_ATTEMPTS 1000
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PHOTON_SSE
+#include <emmintrin.h>
+#endif
+
+#define PI 3.141592653589793
 
 namespace raytrace {
 
-    // A recursive method to find the median photon by only computing a partial sort
-    photon *findMedianPhoton(photon** photons, int size, Axis axis) {
-        int k = randutil::nextInt(0, size);
-        // choose a photon at random
-        photon *p = photons[k];
-        photon** scratch = new photon*[size];
-        int less_index = 0;
-        int great_index = size - 1;
-        double p_val;
+    // A mask over the directions photons leave the light marking the cells which could hit an
+    // object that reflects or transmits specularly, from "Global Illumination using Photon Maps" by Jensen
+    // the directions are laid out by sin^2 theta and phi so that every cell is equally likely under the
+    // light's cosine distribution, and each patch of the light has its own mask
+    struct projection_map {
+        // the index of every marked cell of each patch, with room for every cell of each patch
+        int32 *cells;
+        int32 *counts;
+        // the running total of the patches' marked cells for picking a patch in proportion to them
+        int32 *cumulative;
+        // the fraction of the light's emission covered by the marked cells
+        double coverage;
+    };
+
+    // The photons one tracing job emitted in every direction and through the projection map, including
+    // the ones it didn't store
+    struct photon_job_counts {
+        int64 emitted;
+        int64 projected;
+        // the photons emitted in every direction by the time the job's caustic slice was full, the
+        // caustics of any emitted after that were thrown away
+        int64 caustic_emitted;
+        // the caustics stored in the job's slice, which falls short if it gave up on the projection map
+        int32 caustics;
+    };
+
+    // data shared by every photon tracing job
+    struct photon_trace_context {
+        Vec3 *light_color;
+        Scene *scene;
+        // the directions caustic photons are emitted in once a job's global photons are done
+        projection_map *projection;
+        // the photons of each map along with the index of the object each photon landed on
+        photon *global_photons;
+        int32 *global_objects;
+        int32 global_count;
+        photon *caustic_photons;
+        int32 *caustic_objects;
+        int32 caustic_count;
+        // what each job emitted and stored
+        photon_job_counts *counts;
+    };
+
+    // data used by each photon tracing job, which fills the slice of each map's photons at its index
+    struct photon_task_data {
+        // the index of the job and the pass of a progressive render which pick its stream of random numbers
+        int32 index;
+        int32 pass;
+        photon_trace_context *context;
+    };
+
+    // lookup tables for decoding the direction of a photon
+    double cos_theta[256];
+    double sin_theta[256];
+    double cos_phi[256];
+    double sin_phi[256];
+
+    void initPhotonTables() {
+        for (int i = 0; i < 256; i++) {
+            // each angle decodes to the middle of its range
+            double theta = (i + 0.5) * (PI / 256);
+            double phi = (i + 0.5) * (2 * PI / 256);
+            cos_theta[i] = cos(theta);
+            sin_theta[i] = sin(theta);
+            cos_phi[i] = cos(phi);
+            sin_phi[i] = sin(phi);
+        }
+    }
+
+    // stores the power as a shared exponent color, from "Real Pixels" by Greg Ward in Graphics Gems II
+    void setPhotonPower(photon_payload *p, Vec3 &power) {
+        double v = power.x > power.y ? power.x : power.y;
+        v = power.z > v ? power.z : v;
+        if (v < 1e-32) {
+            p->power[0] = 0;
+            p->power[1] = 0;
+            p->power[2] = 0;
+            p->power[3] = 0;
+            return;
+        }
+        int exponent;
+        double m = frexp(v, &exponent) * 256.0 / v;
+        p->power[0] = (uint8) (power.x * m);
+        p->power[1] = (uint8) (power.y * m);
+        p->power[2] = (uint8) (power.z * m);
+        p->power[3] = (uint8) (exponent + 128);
+    }
+
+    void photonPower(photon_payload *p, double *result) {
+        if (p->power[3] == 0) {
+            result[0] = 0;
+            result[1] = 0;
+            result[2] = 0;
+            return;
+        }
+        double f = ldexp(1.0, p->power[3] - (128 + 8));
+        result[0] = (p->power[0] + 0.5) * f;
+        result[1] = (p->power[1] + 0.5) * f;
+        result[2] = (p->power[2] + 0.5) * f;
+    }
+
+    void setPhotonDirection(photon_payload *p, Vec3 &direction) {
+        double z = direction.z < -1 ? -1 : (direction.z > 1 ? 1 : direction.z);
+        int32 theta = (int32) (acos(z) * (256 / PI));
+        int32 phi = (int32) floor(atan2(direction.y, direction.x) * (256 / (2 * PI)));
+        p->theta = (uint8) (theta > 255 ? 255 : theta);
+        // wrap the negative angles around
+        p->phi = (uint8) (phi & 0xFF);
+    }
+
+    void photonDirection(photon_payload *p, Vec3 *result) {
+        result->set(sin_theta[p->theta] * cos_phi[p->phi], sin_theta[p->theta] * sin_phi[p->phi], cos_theta[p->theta]);
+    }
+
+    float photonAxis(photon *p, int axis) {
         if (axis == X_AXIS) {
-            p_val = p->x;
+            return p->x;
         } else if (axis == Y_AXIS) {
-            p_val = p->y;
-        } else {
-            p_val = p->z;
+            return p->y;
         }
-        // split the photons into those less and greater than our chosen photon
-        for (int i = 0; i < size; i++) {
-            photon *next = photons[i];
-            if (next == p) {
-                continue;
-            }
-            double val;
-            if (axis == X_AXIS) {
-                val = next->x;
-            } else if (axis == Y_AXIS) {
-                val = next->y;
-            } else {
-                val = next->z;
+        return p->z;
+    }
+
+    // data used by each kd-tree building job
+    struct kdtree_task_data {
+        photon **photons;
+        int32 start;
+        int32 end;
+        KDTree *tree;
+        int32 index;
+        int32 level;
+        scheduler::JobGroup *group;
+    };
+
+    void buildKDTree(photon **photons, int32 start, int32 end, KDTree *tree, int32 index, int32 level, scheduler::JobGroup *group);
+
+    void kdtree_task(void *vdata) {
+        kdtree_task_data *data = (kdtree_task_data*) vdata;
+        buildKDTree(data->photons, data->start, data->end, data->tree, data->index, data->level, data->group);
+    }
+
+    // builds the subtree at the given index, as a separate job if it is large enough
+    void buildSubtree(photon **photons, int32 start, int32 end, KDTree *tree, int32 index, int32 level, scheduler::JobGroup *group) {
+        if (end - start < KDTREE_JOB_SIZE) {
+            buildKDTree(photons, start, end, tree, index, level, group);
+            return;
+        }
+        kdtree_task_data data;
+        data.photons = photons;
+        data.start = start;
+        data.end = end;
+        data.tree = tree;
+        data.index = index;
+        data.level = level;
+        data.group = group;
+        scheduler::submit(kdtree_task, data, group);
+    }
+
+    // copies the photons of a leaf into its bucket
+    // only the bucket's own start is written since the next bucket may be built by another job at the same time
+    void buildBucket(photon **photons, int32 start, int32 end, KDTree *tree, int32 bucket) {
+        tree->buckets[bucket] = start;
+        int32 count = end - start;
+        float *xs = &tree->positions[3 * start];
+        float *ys = xs + count;
+        float *zs = ys + count;
+        for (int32 i = 0; i < count; i++) {
+            photon *p = photons[start + i];
+            tree->payloads[start + i] = p->payload;
+            xs[i] = p->x;
+            ys[i] = p->y;
+            zs[i] = p->z;
+        }
+    }
+
+    // recursively splits photons[start, end) at its median until the ranges fit in a bucket
+    // the photons are partitioned in place so the two subtrees cover disjoint ranges and can be
+    // built at the same time
+    void buildKDTree(photon **photons, int32 start, int32 end, KDTree *tree, int32 index, int32 level, scheduler::JobGroup *group) {
+        if (level == tree->depth) {
+            buildBucket(photons, start, end, tree, index - ((1 << tree->depth) - 1));
+            return;
+        }
+        // find the bounds of the photons and split along the largest axis
+        float min[3] = { 1e30f, 1e30f, 1e30f };
+        float max[3] = { -1e30f, -1e30f, -1e30f };
+        for (int32 i = start; i < end; i++) {
+            for (int j = 0; j < 3; j++) {
+                float v = photonAxis(photons[i], j);
+                min[j] = v < min[j] ? v : min[j];
+                max[j] = v > max[j] ? v : max[j];
             }
-            if (val <= p_val) {
-                scratch[less_index++] = next;
-            } else {
-                scratch[great_index--] = next;
+        }
+        Axis split = largestAxis(max[0] - min[0], max[1] - min[1], max[2] - min[2]);
+        int32 median = start + (end - start) / 2;
+        std::nth_element(photons + start, photons + median, photons + end, [split](photon *l, photon *r) {
+            return photonAxis(l, split) < photonAxis(r, split);
+        });
+        kdsplit *node = &tree->splits[index];
+        node->value = photonAxis(photons[median], split);
+        node->axis = split;
+        buildSubtree(photons, start, median, tree, 2 * index + 1, level + 1, group);
+        buildSubtree(photons, median, end, tree, 2 * index + 2, level + 1, group);
+    }
+
+    // creates a k dimensional tree from the given array of photons
+    KDTree::KDTree(photon *source, int32 count) {
+        size = count;
+        owned = true;
+        // split until every bucket holds at most KD_BUCKET_SIZE photons, halving the photons at
+        // each level leaves every bucket at least half full
+        depth = 0;
+        while ((int64) KD_BUCKET_SIZE << depth < size) {
+            depth++;
+        }
+        int32 bucket_count = 1 << depth;
+        splits = new kdsplit[bucket_count];
+        buckets = new int32[bucket_count + 1];
+        payloads = new photon_payload[size > 0 ? size : 1];
+        positions = new float[3 * size + KD_BUCKET_SIZE];
+        // the last bucket reads past the end, which is never gathered but shouldn't be garbage either
+        for (int32 i = 0; i < KD_BUCKET_SIZE; i++) {
+            positions[3 * size + i] = 1e30f;
+        }
+        photon **order = new photon*[size > 0 ? size : 1];
+        for (int32 i = 0; i < size; i++) {
+            order[i] = &source[i];
+        }
+        scheduler::JobGroup group;
+        buildSubtree(order, 0, size, this, 0, 0, &group);
+        scheduler::wait(&group);
+        buckets[bucket_count] = size;
+        delete[] order;
+        aggregates = nullptr;
+    }
+
+    KDTree::KDTree(photon_payload *payloads0, int32 count, int32 depth0, kdsplit *splits0, int32 *buckets0, float *positions0, kdaggregate *aggregates0) {
+        size = count;
+        owned = false;
+        depth = depth0;
+        splits = splits0;
+        buckets = buckets0;
+        payloads = payloads0;
+        positions = positions0;
+        aggregates = aggregates0;
+    }
+
+    KDTree::~KDTree() {
+        if (owned) {
+            delete[] splits;
+            delete[] buckets;
+            delete[] payloads;
+            delete[] positions;
+            delete[] aggregates;
+        }
+    }
+
+    // sums up the photons of a bucket
+    void aggregateBucket(KDTree *tree, int32 bucket, kdaggregate *result) {
+        int32 start = tree->buckets[bucket];
+        int32 end = tree->buckets[bucket + 1];
+        result->count = end - start;
+        for (int j = 0; j < 3; j++) {
+            result->min[j] = 1e30f;
+            result->max[j] = -1e30f;
+            result->direction_min[j] = 1;
+            result->direction_max[j] = -1;
+            for (int c = 0; c < 3; c++) {
+                result->flux[c][j] = 0;
             }
         }
-        photon *r;
-        if (less_index == size / 2) {
-            // the chosen photon was the median photon
-            r = p;
-        } else if (less_index > size / 2) {
-            // more photons were less than our photon so recurse into that side
-            r = findMedianPhoton(scratch, less_index, axis);
-        } else {
-            // more photons were greater than our photon so recurse into that side
-            r = findMedianPhoton(scratch + great_index + 1, size - great_index - 1, axis);
+        Vec3 direction(0, 0, 0);
+        float d[3];
+        double power[3];
+        float *xs = &tree->positions[3 * start];
+        for (int32 i = start; i < end; i++) {
+            photon_payload *p = &tree->payloads[i];
+            for (int j = 0; j < 3; j++) {
+                float v = xs[j * result->count + i - start];
+                result->min[j] = v < result->min[j] ? v : result->min[j];
+                result->max[j] = v > result->max[j] ? v : result->max[j];
+            }
+            photonDirection(p, &direction);
+            photonPower(p, power);
+            for (int c = 0; c < 3; c++) {
+                result->flux[c][0] -= (float) (power[c] * direction.x);
+                result->flux[c][1] -= (float) (power[c] * direction.y);
+                result->flux[c][2] -= (float) (power[c] * direction.z);
+            }
+            d[0] = (float) direction.x;
+            d[1] = (float) direction.y;
+            d[2] = (float) direction.z;
+            for (int j = 0; j < 3; j++) {
+                result->direction_min[j] = d[j] < result->direction_min[j] ? d[j] : result->direction_min[j];
+                result->direction_max[j] = d[j] > result->direction_max[j] ? d[j] : result->direction_max[j];
+            }
         }
-        delete[] scratch;
-        return r;
     }
 
-    // creates a k dimensional tree from the given array of photons
-    kdnode *createKDTree(photon **photons, int size, photon **scratch, int scratch_size) {
-        Vec3 min(1000, 1000, 1000);
-        Vec3 max(-1000, -1000, -1000);
-        // find the min and max bounds of our photons
-        for (int i = 0; i < size; i++) {
-            photon *next = photons[i];
-            if (next->x < min.x) {
-                min.x = next->x;
-            }
-            if (next->x > max.x) {
-                max.x = next->x;
-            }
-            if (next->y < min.y) {
-                min.y = next->y;
-            }
-            if (next->y > max.y) {
-                max.y = next->y;
-            }
-            if (next->z < min.z) {
-                min.z = next->z;
-            }
-            if (next->z > max.z) {
-                max.z = next->z;
-            }
-        }
-        // we split the photons along the largest axis
-        double x_size = (max.x - min.x);
-        double y_size = (max.y - min.y);
-        double z_size = (max.z - min.z);
-        Axis split = largestAxis(x_size, y_size, z_size);
-        photon *median = findMedianPhoton(photons, size, split);
-        double m_val;
-        if (split == X_AXIS) {
-            m_val = median->x;
-        } else if (split == Y_AXIS) {
-            m_val = median->y;
-        } else {
-            m_val = median->z;
-        }
-        int less_index = 0;
-        int greater_index = size - 1;
-        // split the photons into groups less or greater than our median photon
-        for (int i = 0; i < size; i++) {
-            photon *next = photons[i];
-            if (next == median) {
-                continue;
+    // combines the aggregates of two sets of photons
+    void mergeAggregates(kdaggregate *a, kdaggregate *b, kdaggregate *result) {
+        if (a->count == 0 || b->count == 0) {
+            *result = a->count == 0 ? *b : *a;
+            return;
+        }
+        result->count = a->count + b->count;
+        for (int j = 0; j < 3; j++) {
+            result->min[j] = a->min[j] < b->min[j] ? a->min[j] : b->min[j];
+            result->max[j] = a->max[j] > b->max[j] ? a->max[j] : b->max[j];
+            result->direction_min[j] = a->direction_min[j] < b->direction_min[j] ? a->direction_min[j] : b->direction_min[j];
+            result->direction_max[j] = a->direction_max[j] > b->direction_max[j] ? a->direction_max[j] : b->direction_max[j];
+            for (int c = 0; c < 3; c++) {
+                result->flux[c][j] = a->flux[c][j] + b->flux[c][j];
             }
-            double val;
-            if (split == X_AXIS) {
-                val = next->x;
-            } else if (split == Y_AXIS) {
-                val = next->y;
+        }
+    }
+
+    // fills the aggregates bottom up, the buckets are summed as they're needed rather than kept
+    void KDTree::aggregate() {
+        int32 first_bucket = (1 << depth) - 1;
+        aggregates = new kdaggregate[first_bucket > 0 ? first_bucket : 1];
+        kdaggregate left;
+        kdaggregate right;
+        for (int32 i = first_bucket - 1; i >= 0; i--) {
+            if (2 * i + 1 >= first_bucket) {
+                aggregateBucket(this, 2 * i + 1 - first_bucket, &left);
+                aggregateBucket(this, 2 * i + 2 - first_bucket, &right);
+                mergeAggregates(&left, &right, &aggregates[i]);
             } else {
-                val = next->z;
+                mergeAggregates(&aggregates[2 * i + 1], &aggregates[2 * i + 2], &aggregates[i]);
             }
-            if (val <= m_val) {
-                scratch[less_index++] = next;
-            } else {
-                scratch[greater_index--] = next;
+        }
+    }
+
+    // walks down towards the target to the smallest node still holding k photons and estimates the
+    // irradiance from its photons spread evenly over its bounds
+    bool KDTree::coarseIrradiance(Vec3 *target, Vec3 *normal, int32 k, double max_radius, double *result) {
+        int32 first_bucket = (1 << depth) - 1;
+        if (aggregates == nullptr || first_bucket == 0 || aggregates[0].count < k) {
+            return false;
+        }
+        float tx[3] = { (float) target->x, (float) target->y, (float) target->z };
+        int32 index = 0;
+        while (true) {
+            kdsplit *split = &splits[index];
+            int32 child = tx[split->axis] - split->value < 0 ? 2 * index + 1 : 2 * index + 2;
+            if (child >= first_bucket || aggregates[child].count < k) {
+                break;
             }
+            index = child;
         }
-        kdnode *node = new kdnode;
-        node->splitting_axis = split;
-        node->value = median;
-        // recurse into the left and right sides if there are any photons left there
-        if (less_index != 0) {
-            node->left = createKDTree(scratch, less_index, photons, less_index);
-        } else {
-            node->left = nullptr;
+        kdaggregate *node = &aggregates[index];
+        double extent[3];
+        // the target is within the node's cell but can still be far from where its photons landed
+        double outside = 0;
+        for (int j = 0; j < 3; j++) {
+            extent[j] = node->max[j] - node->min[j];
+            double d = tx[j] < node->min[j] ? node->min[j] - tx[j] : (tx[j] > node->max[j] ? tx[j] - node->max[j] : 0);
+            outside += d * d;
+        }
+        if (outside > max_radius * max_radius || 0.25 * (extent[0] * extent[0] + extent[1] * extent[1] + extent[2] * extent[2]) > max_radius * max_radius) {
+            return false;
+        }
+        // the summed flux only gives the cosine weighted power if every photon arrives from in front,
+        // which holds when even the direction within the bounds facing the most along the normal
+        // still points into the surface
+        double facing = 0;
+        double n[3] = { normal->x, normal->y, normal->z };
+        for (int j = 0; j < 3; j++) {
+            facing += n[j] > 0 ? n[j] * node->direction_max[j] : n[j] * node->direction_min[j];
+        }
+        if (facing > COARSE_MAX_FACING) {
+            return false;
+        }
+        // the photons lie on a surface so it covers about the two largest sides of the bounds
+        std::sort(extent, extent + 3);
+        double area = extent[1] * extent[2];
+        if (area <= 0) {
+            return false;
         }
-        if (greater_index < size - 1) {
-            node->right = createKDTree(scratch + greater_index + 1, size - (greater_index + 1), photons + (greater_index + 1), size - (greater_index + 1));
+        for (int c = 0; c < 3; c++) {
+            result[c] = normal->dot(node->flux[c][0], node->flux[c][1], node->flux[c][2]) / (COARSE_FILTER_SCALE * area);
+        }
+        return true;
+    }
+
+    photon_gather *createGather(int32 capacity) {
+        photon_gather *gather = new photon_gather;
+        gather->payloads = new photon_payload*[capacity > 0 ? capacity : 1];
+        gather->distances = new double[capacity > 0 ? capacity : 1];
+        gather->capacity = capacity;
+        gather->k = 0;
+        gather->size = 0;
+        return gather;
+    }
+
+    void deleteGather(photon_gather *gather) {
+        delete[] gather->payloads;
+        delete[] gather->distances;
+        delete gather;
+    }
+
+    void beginGather(photon_gather *gather, int32 k) {
+        gather->k = k < gather->capacity ? k : gather->capacity;
+        gather->size = 0;
+    }
+
+    // the squared distance to the farthest photon gathered so far
+    double gatherRadius(photon_gather *gather) {
+        if (gather->size == 0) {
+            return 0;
+        }
+        if (gather->k <= GATHER_SORTED_SIZE) {
+            return gather->distances[gather->size - 1];
+        }
+        return gather->distances[0];
+    }
+
+    // adds a photon to the sorted array used for small k, dropping the farthest if it's full
+    void insertSorted(photon_gather *gather, photon_payload *next, double dist) {
+        int32 i;
+        if (gather->size < gather->k) {
+            i = gather->size++;
+        } else if (dist < gather->distances[gather->size - 1]) {
+            i = gather->size - 1;
         } else {
-            node->right = nullptr;
+            return;
+        }
+        // shift the farther photons up to make room
+        while (i > 0 && gather->distances[i - 1] > dist) {
+            gather->distances[i] = gather->distances[i - 1];
+            gather->payloads[i] = gather->payloads[i - 1];
+            i--;
         }
-        return node;
+        gather->distances[i] = dist;
+        gather->payloads[i] = next;
     }
 
-    void insert(photon **nearest, double *distances, int k, int size, photon *next, double dist) {
-        // inserts a photon into a max-heap in the `nearest` array
-        if (size < k) {
+    // adds a photon to the max-heap used for large k, replacing the farthest if it's full
+    void insertHeap(photon_gather *gather, photon_payload *next, double dist) {
+        photon_payload **nearest = gather->payloads;
+        double *distances = gather->distances;
+        if (gather->size < gather->k) {
             // our heap isn't full so just insert the photon into the next slot
             // and ensure that the heap property is still satisfied
-            int i = size;
-            nearest[i] = next;
-            distances[i] = dist;
+            int32 i = gather->size++;
             while (i != 0) {
                 // heapify up
-                int parent = (i - 1) / 2;
-                if (distances[parent] >= distances[i]) {
+                int32 parent = (i - 1) / 2;
+                if (distances[parent] >= dist) {
                     break;
                 }
-                double t = distances[parent];
-                photon *tp = nearest[parent];
-                distances[parent] = distances[i];
-                nearest[parent] = nearest[i];
-                distances[i] = t;
-                nearest[i] = tp;
+                distances[i] = distances[parent];
+                nearest[i] = nearest[parent];
                 i = parent;
             }
+            distances[i] = dist;
+            nearest[i] = next;
         } else {
-            // otherwise if out photon is closer than the farthest away photon (the root
+            // otherwise if our photon is closer than the farthest away photon (the root
             // of the max-heap) then replace the root and heapify downwards to ensure the
             // heap property
             if (dist > distances[0]) {
                 return;
             }
-            distances[0] = dist;
-            nearest[0] = next;
-            int i = 0;
-            while (i < 31) {
+            int32 size = gather->size;
+            int32 i = 0;
+            while (2 * i + 1 < size) {
                 // heapify down the largest child node
-                if (distances[2 * i + 1] < distances[2 * i + 2]) {
-                    if (distances[2 * i + 2] > distances[i]) {
-                        int parent = i;
-                        i = 2 * i + 2;
-                        double t = distances[parent];
-                        photon *tp = nearest[parent];
-                        distances[parent] = distances[i];
-                        nearest[parent] = nearest[i];
-                        distances[i] = t;
-                        nearest[i] = tp;
-                    } else {
-                        break;
-                    }
-                } else {
-                    if (distances[2 * i + 1] > distances[i]) {
-                        int parent = i;
-                        i = 2 * i + 1;
-                        double t = distances[parent];
-                        photon *tp = nearest[parent];
-                        distances[parent] = distances[i];
-                        nearest[parent] = nearest[i];
-                        distances[i] = t;
-                        nearest[i] = tp;
-                    } else {
-                        break;
+                int32 child = 2 * i + 1;
+                if (child + 1 < size && distances[child] < distances[child + 1]) {
+                    child++;
+                }
+                if (distances[child] <= dist) {
+                    break;
+                }
+                distances[i] = distances[child];
+                nearest[i] = nearest[child];
+                i = child;
+            }
+            distances[i] = dist;
+            nearest[i] = next;
+        }
+    }
+
+    void gatherPhoton(photon_gather *gather, photon_payload *next, double dist) {
+        if (gather->k <= GATHER_SORTED_SIZE) {
+            insertSorted(gather, next, dist);
+        } else {
+            insertHeap(gather, next, dist);
+        }
+    }
+
+    // computes the squared distance from the target to the count photons of a bucket, the slots past
+    // them are filled with whatever follows and have to be ignored
+    void bucketDistances(float *xs, int32 count, float *tx, float *result) {
+        float *ys = xs + count;
+        float *zs = ys + count;
+#ifdef PHOTON_SSE
+        __m128 x = _mm_set1_ps(tx[0]);
+        __m128 y = _mm_set1_ps(tx[1]);
+        __m128 z = _mm_set1_ps(tx[2]);
+        for (int i = 0; i < KD_BUCKET_SIZE; i += 4) {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), x);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + i), y);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(zs + i), z);
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            _mm_storeu_ps(result + i, d);
+        }
+#else
+        for (int i = 0; i < count; i++) {
+            float dx = xs[i] - tx[0];
+            float dy = ys[i] - tx[1];
+            float dz = zs[i] - tx[2];
+            result[i] = dx * dx + dy * dy + dz * dz;
+        }
+#endif
+    }
+
+    // performs a nearest neighbour search of the tree to find the nearest set of photons
+    // the subtrees still to be searched are kept on a stack along with the squared distance from
+    // the target to their splitting plane so that they can be skipped once the heap is full
+    int KDTree::findNearest(photon_gather *gather, Vec3 *target, double max_dist) {
+        float tx[3] = { (float) target->x, (float) target->y, (float) target->z };
+        int32 first_bucket = (1 << depth) - 1;
+        int32 stack[KD_STACK_SIZE];
+        float stack_dist[KD_STACK_SIZE];
+        int32 stack_size = 1;
+        stack[0] = 0;
+        stack_dist[0] = 0;
+        alignas(16) float bucket_dist[KD_BUCKET_SIZE];
+        while (stack_size > 0) {
+            stack_size--;
+            int32 index = stack[stack_size];
+            double plane_dist = stack_dist[stack_size];
+            // once the gather is full only photons closer than its farthest one are of interest
+            double limit = gather->size == gather->k ? gatherRadius(gather) : max_dist;
+            if (plane_dist >= limit) {
+                continue;
+            }
+            // walk down to the bucket on our side of each plane, saving the other side for later
+            while (index < first_bucket) {
+                kdsplit *node = &splits[index];
+                float d = tx[node->axis] - node->value;
+                int32 near_index = d < 0 ? 2 * index + 1 : 2 * index + 2;
+                stack[stack_size] = d < 0 ? 2 * index + 2 : 2 * index + 1;
+                stack_dist[stack_size] = d * d;
+                stack_size++;
+                index = near_index;
+            }
+            int32 bucket = index - first_bucket;
+            int32 start = buckets[bucket];
+            int32 count = buckets[bucket + 1] - start;
+            bucketDistances(&positions[3 * start], count, tx, bucket_dist);
+            for (int32 i = 0; i < count; i++) {
+                double dist = bucket_dist[i];
+                if (dist < limit) {
+                    gatherPhoton(gather, &payloads[start + i], dist);
+                    if (gather->size == gather->k) {
+                        limit = gatherRadius(gather);
                     }
                 }
             }
         }
+        return gather->size;
+    }
 
+    void KDTree::getPhoton(int32 i, photon *result) {
+        // the bucket holding the photon is the last one starting at or before it
+        int32 bucket = (int32) (std::upper_bound(buckets, buckets + (1 << depth), i) - buckets) - 1;
+        int32 start = buckets[bucket];
+        int32 count = buckets[bucket + 1] - start;
+        float *xs = &positions[3 * start];
+        result->x = xs[i - start];
+        result->y = xs[count + i - start];
+        result->z = xs[2 * count + i - start];
+        result->payload = payloads[i];
     }
 
-    // performs a nearest neighbour search of a k-dimensional tree to find the nearest set
-    // of photons
-    int find_nearest_photons(photon **nearest, double *distances, int k, int size, Vec3 *target, kdnode *root, double max_dist) {
-        double dx = root->value->x - target->x;
-        double dy = root->value->y - target->y;
-        double dz = root->value->z - target->z;
-        double dist = dx * dx + dy * dy + dz * dz;
-        if (dist < max_dist) {
-            if (size < k) {
-                insert(nearest, distances, k, size, root->value, dist);
-                size++;
-            } else if (dist < distances[0]) {
-                insert(nearest, distances, k, size, root->value, dist);
+    int find_nearest_photons(photon_gather *gather, Vec3 *target, PhotonIndex *index, double max_dist) {
+        if (index->size == 0 || gather->k == 0) {
+            return gather->size;
+        }
+        return index->findNearest(gather, target, max_dist);
+    }
+
+    gather_cache *createGatherCache() {
+        gather_cache *cache = new gather_cache;
+        for (int32 i = 0; i < GATHER_CACHE_SIZE; i++) {
+            cache->entries[i].index = nullptr;
+            cache->entries[i].used = 0;
+        }
+        cache->clock = 0;
+        return cache;
+    }
+
+    void deleteGatherCache(gather_cache *cache) {
+        delete cache;
+    }
+
+    int findNearestCached(gather_cache *cache, photon_gather *gather, Vec3 *target, PhotonIndex *index, double max_dist) {
+        if (cache == nullptr || index->size == 0 || gather->k == 0) {
+            return find_nearest_photons(gather, target, index, max_dist);
+        }
+        // look for the index's own entry, so the global and caustic indexes of an object gathered one
+        // after the other at each hit never evict each other
+        gather_cache_entry *entry = nullptr;
+        gather_cache_entry *oldest = &cache->entries[0];
+        for (int32 i = 0; i < GATHER_CACHE_SIZE; i++) {
+            gather_cache_entry *next = &cache->entries[i];
+            if (next->index == index) {
+                entry = next;
+                break;
+            }
+            if (next->used < oldest->used) {
+                oldest = next;
             }
         }
+        double limit = max_dist;
+        if (entry != nullptr && entry->k == gather->k && entry->max_dist == max_dist) {
+            // the last gather's k photons are all within its radius plus however far we've moved, so
+            // our k nearest are too
+            double dx = target->x - entry->x;
+            double dy = target->y - entry->y;
+            double dz = target->z - entry->z;
+            double bound = (entry->radius + sqrt(dx * dx + dy * dy + dz * dz)) * GATHER_CACHE_MARGIN;
+            limit = bound * bound < max_dist ? bound * bound : max_dist;
+        }
+        int found = index->findNearest(gather, target, limit);
+        if (found < gather->k && limit < max_dist) {
+            // rounding left us short so search again over the whole radius
+            beginGather(gather, gather->k);
+            found = index->findNearest(gather, target, max_dist);
+        }
+        // only a full gather bounds the next one
+        if (found == gather->k) {
+            if (entry == nullptr) {
+                entry = oldest;
+            }
+            entry->used = ++cache->clock;
+            entry->index = index;
+            entry->k = gather->k;
+            entry->max_dist = max_dist;
+            entry->x = target->x;
+            entry->y = target->y;
+            entry->z = target->z;
+            entry->radius = sqrt(gatherRadius(gather));
+        } else if (entry != nullptr) {
+            entry->index = nullptr;
+            entry->used = 0;
+        }
+        return found;
+    }
+
+    // renders the photons approximately to a pane for debugging
+    void showPhotons(uint32 *pane, PhotonIndex *index) {
+        photon p;
+        for (int32 i = 0; i < index->size; i++) {
+            index->getPhoton(i, &p);
+            double dz = p.z;
+            Vec3 dir(-p.x, -p.y, -12 - p.z);
+            dir.normalize();
+            dir.mul((dz / dir.z));
+
+            int x0 = fastfloor(dir.x * 142) + 640;
+            int y0 = fastfloor(dir.y * 142) + 360;
+            pane[x0 + y0 * 1280] = 0xFFFF00FF;
+        }
+    }
 
-        // determine which side of the splitting plane we are on
-        // true is positive side
-        bool side = true;
-        double axis_dist;
-        if (root->splitting_axis == X_AXIS) {
-            side = target->x <= root->value->x;
-            axis_dist = dx * dx;
-        } else if (root->splitting_axis == Y_AXIS) {
-            side = target->y <= root->value->y;
-            axis_dist = dy * dy;
-        } else if (root->splitting_axis == Z_AXIS) {
-            side = target->z <= root->value->z;
-            axis_dist = dz * dz;
+    // estimates the irradiance at a point from the k nearest photons in the tree
+    void estimateIrradiance(photon_gather *gather, gather_cache *cache, PhotonIndex *index, int32 k, Vec3 *point, Vec3 *normal, double max_dist, double *result) {
+        result[0] = 0;
+        result[1] = 0;
+        result[2] = 0;
+        beginGather(gather, k);
+        int found = findNearestCached(cache, gather, point, index, max_dist);
+        if (found == 0) {
+            return;
+        }
+        double r = gatherRadius(gather);
+        Vec3 direction(0, 0, 0);
+        double power[3];
+        for (int i = 0; i < found; i++) {
+            photon_payload *ph = gather->payloads[i];
+            photonDirection(ph, &direction);
+            photonPower(ph, power);
+            // check the angle of incidence of the photon relative to the surface normal
+            double d = -normal->dot(&direction);
+            if (d <= 0) {
+                continue;
+            }
+            // decrease the power of the photon by the square of the distance from
+            // the sampled point
+            double filter = (1 - gather->distances[i] / r);
+            filter = filter * filter;
+            result[0] += d * power[0] * filter;
+            result[1] += d * power[1] * filter;
+            result[2] += d * power[2] * filter;
         }
+        // divide the intensities by the area to get a density approximation
+        result[0] /= (3.141592653589 * 2 * r);
+        result[1] /= (3.141592653589 * 2 * r);
+        result[2] /= (3.141592653589 * 2 * r);
+    }
+
+    // data used by each irradiance precompute job
+    struct irradiance_task_data {
+        photon_map *map;
+        // the precomputed photons of the object this job fills
+        photon *irradiance;
+        Scene *scene;
+        int32 object;
+        // the range of precomputed photons this job fills
+        int32 start;
+        int32 count;
+        int32 k;
+        double max_dist;
+    };
 
-        // recurse into that side first
-        kdnode *side_node = side ? root->left : root->right;
-        if (side_node != nullptr) {
-            size = find_nearest_photons(nearest, distances, k, size, target, side_node, max_dist);
+    void irradiance_task(void *vdata) {
+        irradiance_task_data *data = (irradiance_task_data*) vdata;
+        PhotonIndex *index = data->map->indexes[data->object];
+        SceneObject *object = data->scene->objects[data->object];
+        photon_gather *gather = createGather(data->k);
+        Vec3 point(0, 0, 0);
+        Vec3 normal(0, 0, 0);
+        Vec3 irradiance(0, 0, 0);
+        double result[3];
+        for (int32 i = data->start; i < data->start + data->count; i++) {
+            // the precomputed photon is stored at the same spot with the irradiance as its power
+            photon *next = &data->irradiance[i];
+            index->getPhoton(i * IRRADIANCE_STRIDE, next);
+            point.set(next->x, next->y, next->z);
+            object->normal(&point, &normal, 0);
+            estimateIrradiance(gather, nullptr, index, data->k, &point, &normal, data->max_dist, result);
+            irradiance.set(result[0], result[1], result[2]);
+            setPhotonPower(&next->payload, irradiance);
         }
+        deleteGather(gather);
+    }
 
-        // check if the current max distance is larger than the distance from the target to the splitting plane
-        if (size == 0 || distances[0] > axis_dist) {
-            // if yes then recurse into that side as well
-            side_node = !side ? root->left : root->right;
-            if (side_node != nullptr) {
-                size = find_nearest_photons(nearest, distances, k, size, target, side_node, max_dist);
+    // precomputes the irradiance at a subset of the photons on each object from the k nearest
+    // photons, so that a render can look up the irradiance from a single nearest photon
+    // based on "Faster Photon Map Global Illumination" by Per H. Christensen
+    void precomputeIrradiance(photon_map *map, Scene *scene, int32 k, double max_dist) {
+        printf("Precomputing irradiance\n");
+        auto start = std::chrono::high_resolution_clock::now();
+        photon **irradiance = new photon*[map->count];
+        int32 *sizes = new int32[map->count];
+        scheduler::JobGroup group;
+        for (int32 i = 0; i < map->count; i++) {
+            sizes[i] = (map->indexes[i]->size + IRRADIANCE_STRIDE - 1) / IRRADIANCE_STRIDE;
+            irradiance[i] = new photon[sizes[i] > 0 ? sizes[i] : 1];
+            for (int32 j = 0; j < sizes[i]; j += IRRADIANCE_PER_JOB) {
+                irradiance_task_data data;
+                data.map = map;
+                data.irradiance = irradiance[i];
+                data.scene = scene;
+                data.object = i;
+                data.start = j;
+                data.count = min(IRRADIANCE_PER_JOB, sizes[i] - j);
+                data.k = k;
+                data.max_dist = max_dist;
+                scheduler::submit(irradiance_task, data, &group);
             }
         }
+        scheduler::wait(&group);
+        map->irradiance = new PhotonIndex*[map->count];
+        for (int32 i = 0; i < map->count; i++) {
+            map->irradiance[i] = new KDTree(irradiance[i], sizes[i]);
+            delete[] irradiance[i];
+        }
+        delete[] irradiance;
+        delete[] sizes;
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> duration = (end - start);
+        printf("Irradiance precomputed in %.3fs\n", duration.count());
+    }
 
-        return size;
+    // looks up the precomputed irradiance nearest to the point
+    void lookupIrradiance(photon_gather *gather, PhotonIndex *index, Vec3 *point, double max_dist, double *result) {
+        beginGather(gather, 1);
+        if (find_nearest_photons(gather, point, index, max_dist) == 0) {
+            result[0] = 0;
+            result[1] = 0;
+            result[2] = 0;
+            return;
+        }
+        photonPower(gather->payloads[0], result);
     }
 
-    // renders the photons approximately to a pane for debugging
-    void showPhotons(uint32 *pane, kdnode *tree) {
+    // picks a hash grid cell size for the photons of an object so that a gather of k photons
+    // usually fits within one cell of the target
+    double gridRadius(photon *photons, int32 size, int32 k) {
+        if (size == 0) {
+            return 1;
+        }
+        float min[3] = { 1e30f, 1e30f, 1e30f };
+        float max[3] = { -1e30f, -1e30f, -1e30f };
+        for (int32 i = 0; i < size; i++) {
+            for (int j = 0; j < 3; j++) {
+                float v = photonAxis(&photons[i], j);
+                min[j] = v < min[j] ? v : min[j];
+                max[j] = v > max[j] ? v : max[j];
+            }
+        }
+        // the photons lie on a surface so we approximate its area by the two largest sides of the bounds
+        double sides[3] = { max[0] - min[0], max[1] - min[1], max[2] - min[2] };
+        std::sort(sides, sides + 3);
+        double area = sides[1] * sides[2];
+        double radius = sqrt(k * area / (PI * size)) * GRID_RADIUS_SCALE;
+        return radius > GRID_MIN_RADIUS ? radius : GRID_MIN_RADIUS;
+    }
 
-        double dz = tree->value->z;
-        Vec3 dir(-tree->value->x, -tree->value->y, -12 - tree->value->z);
-        dir.normalize();
-        dir.mul((dz / dir.z));
+    // sorts the photons by the object they landed on and builds an index for each object, the kd-trees
+    // sum up their photons too if they're aggregated
+    photon_map *createObjectMaps(photon *photons, int32 *objects, int32 size, int32 object_count, PhotonBackend backend, int32 k, bool aggregated) {
+        photon_map *map = new photon_map;
+        map->count = object_count;
+        map->irradiance = nullptr;
+        map->backend = backend;
+        map->file = nullptr;
+        map->indexes = new PhotonIndex*[object_count];
+        int32 *offsets = new int32[object_count + 1];
+        for (int32 i = 0; i <= object_count; i++) {
+            offsets[i] = 0;
+        }
+        for (int32 i = 0; i < size; i++) {
+            offsets[objects[i] + 1]++;
+        }
+        for (int32 i = 0; i < object_count; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+        photon *sorted = new photon[size > 0 ? size : 1];
+        int32 *next = new int32[object_count];
+        for (int32 i = 0; i < object_count; i++) {
+            next[i] = offsets[i];
+        }
+        for (int32 i = 0; i < size; i++) {
+            sorted[next[objects[i]]++] = photons[i];
+        }
+        for (int32 i = 0; i < object_count; i++) {
+            photon *object_photons = sorted + offsets[i];
+            int32 count = offsets[i + 1] - offsets[i];
+            if (backend == HASH_GRID_BACKEND) {
+                map->indexes[i] = new HashGrid(object_photons, count, gridRadius(object_photons, count, k));
+            } else {
+                KDTree *tree = new KDTree(object_photons, count);
+                if (aggregated) {
+                    tree->aggregate();
+                }
+                map->indexes[i] = tree;
+            }
+        }
+        delete[] next;
+        delete[] sorted;
+        delete[] offsets;
+        return map;
+    }
 
-        int x0 = fastfloor(dir.x * 142) + 640;
-        int y0 = fastfloor(dir.y * 142) + 360;
-        pane[x0 + y0 * 1280] = 0xFFFF00FF;
+    // the direction leaving the light at a point in the projection map's layout
+    void projectionDirection(double u, double v, Vec3 *result) {
+        // u is sin^2 theta which makes the cosine distribution uniform over the map
+        // formula for distribution from https://www.particleincell.com/2015/cosine-distribution/
+        double sin_theta = sqrt(u);
+        double cos_theta = sqrt(1 - u);
+        double psi = v * 6.2831853;
+        result->set(sin_theta * cos(psi), -cos_theta, sin_theta * sin(psi));
+        result->normalize();
+    }
 
-        if (tree->right != nullptr) {
-            showPhotons(pane, tree->right);
+    // whether any ray leaving within radius of the origin at most angle away from the direction could
+    // hit the bounds, those rays stray from the one along the direction by at most radius plus
+    // angle times the distance travelled so we grow the bounds by that much and test the one ray
+    bool coneHitsBounds(Vec3 &origin, Vec3 &direction, double angle, double radius, Vec3 &min, Vec3 &max) {
+        double lo[3] = { min.x - origin.x, min.y - origin.y, min.z - origin.z };
+        double hi[3] = { max.x - origin.x, max.y - origin.y, max.z - origin.z };
+        double dir[3] = { direction.x, direction.y, direction.z };
+        // the farthest a ray can travel and still reach the bounds
+        double far = 0;
+        for (int i = 0; i < 3; i++) {
+            double d = fabs(lo[i]) > fabs(hi[i]) ? fabs(lo[i]) : fabs(hi[i]);
+            far += d * d;
         }
-        if (tree->left != nullptr) {
-            showPhotons(pane, tree->left);
+        double grow = radius + sqrt(far) * angle;
+        double near_t = 0;
+        double far_t = 1e30;
+        for (int i = 0; i < 3; i++) {
+            double l = lo[i] - grow;
+            double h = hi[i] + grow;
+            if (fabs(dir[i]) < 1e-12) {
+                if (l > 0 || h < 0) {
+                    return false;
+                }
+                continue;
+            }
+            double t0 = l / dir[i];
+            double t1 = h / dir[i];
+            if (t0 > t1) {
+                double t = t0;
+                t0 = t1;
+                t1 = t;
+            }
+            near_t = t0 > near_t ? t0 : near_t;
+            far_t = t1 < far_t ? t1 : far_t;
+            if (near_t > far_t) {
+                return false;
+            }
         }
+        return true;
     }
 
-    // creates the global photon map
-    kdnode *createPhotonMap(int32 photon_size, Vec3 &light_source, Vec3 &light_color, Scene *scene) {
-        printf("Building global photon map from %d photons\n", photon_size);
-        auto start = std::chrono::high_resolution_clock::now();
-        int photon_index = 0;
-        photon **photons = new photon*[photon_size];
-        SceneObject *nearest_obj = nullptr;
-        Vec3 nearest_result(0, 0, 0);
-        Vec3 nearest_normal(0, 0, 0);
-        Vec3 photon_power(light_color);
-        // we keep going until we have the desired number of photons in our map
-        while (photon_index < photon_size) {
-            photon_power.set(&light_color);
-            double x0 = randutil::nextDouble() * 2 - 1;
-            double z0 = randutil::nextDouble() * 2 + 3;
-            double y0 = 4.95;
-            light_source.set(x0, y0, z0);
-            // direction based on cosine distribution
-            // formula for distribution from https://www.particleincell.com/2015/cosine-distribution/
-            double sin_theta = sqrt(randutil::nextDouble());
-            double cos_theta = sqrt(1 - sin_theta*sin_theta);
-            double psi = randutil::nextDouble() * 6.2831853;
-            Vec3 light_dir(sin_theta * cos(psi), -cos_theta, sin_theta * sin(psi));
-            light_dir.normalize();
-            int bounces = 0;
-            SceneObject *exclude = nullptr;
-            while (true) {
-                bounces++;
-                // trace photon
-
-                scene->intersect(light_source, light_dir, exclude, &nearest_result, &nearest_normal, &nearest_obj, 0);
-                if (nearest_obj == nullptr) {
+    // data used by each job marking the cells of one patch of the projection map
+    struct projection_task_data {
+        projection_map *projection;
+        // the direction through the center of each cell and the widest angle from it to the cell's
+        // corners and edges
+        double *centers;
+        double *cell_angles;
+        // the min and max bounds of each specular or transmissive object
+        double *bounds;
+        int32 bounds_count;
+        int32 patch;
+    };
+
+    // marks every cell whose directions could reach a specular or transmissive object from
+    // anywhere on the job's patch of the light
+    void projection_task(void *vdata) {
+        projection_task_data *data = (projection_task_data*) vdata;
+        // the same square light the photons are emitted from
+        Vec3 patch_center(LIGHT_X + (data->patch % PROJECTION_PATCHES + 0.5) * LIGHT_SIZE / PROJECTION_PATCHES, LIGHT_Y,
+            LIGHT_Z + (data->patch / PROJECTION_PATCHES + 0.5) * LIGHT_SIZE / PROJECTION_PATCHES);
+        // rays from anywhere on a patch start within its half diagonal of its center
+        double patch_radius = LIGHT_SIZE * sqrt(0.5) / PROJECTION_PATCHES;
+        int32 *cells = &data->projection->cells[data->patch * PROJECTION_RESOLUTION * PROJECTION_RESOLUTION];
+        int32 count = 0;
+        Vec3 center(0, 0, 0);
+        Vec3 min(0, 0, 0);
+        Vec3 max(0, 0, 0);
+        for (int32 cell = 0; cell < PROJECTION_RESOLUTION * PROJECTION_RESOLUTION; cell++) {
+            center.set(data->centers[cell * 3], data->centers[cell * 3 + 1], data->centers[cell * 3 + 2]);
+            for (int32 i = 0; i < data->bounds_count; i++) {
+                double *bounds = &data->bounds[i * 6];
+                min.set(bounds[0], bounds[1], bounds[2]);
+                max.set(bounds[3], bounds[4], bounds[5]);
+                if (coneHitsBounds(patch_center, center, data->cell_angles[cell], patch_radius, min, max)) {
+                    cells[count++] = cell;
                     break;
                 }
-                // we have a hit time to decide whether to reflect, absorb, or transmit
-                double chance = randutil::nextDouble();
-                if (bounces > 3) {
-                    // force an absorption if we've already bounced too many times
-                    chance = 1;
-                }
-                if (chance < nearest_obj->diffuse_chance + nearest_obj->specular_chance) {
-                    // specular reflection
-                    Vec3 n1(nearest_normal);
-                    n1.mul(n1.x * light_dir.x + n1.y * light_dir.y + n1.z * light_dir.z);
-                    n1.mul(2);
-                    light_source.set(nearest_result.x, nearest_result.y, nearest_result.z);
-                    light_dir.set(light_dir.x - n1.x, light_dir.y - n1.y, light_dir.z - n1.z);
-                    light_dir.normalize();
-                    photon_power.mul(nearest_obj->red, nearest_obj->green, nearest_obj->blue);
-                    // exclude the object we just hit from the next search so we don't hit it again
-                    exclude = nearest_obj;
-                    continue;
-                } else if (chance < nearest_obj->diffuse_chance + nearest_obj->specular_chance + nearest_obj->transmission_chance) {
-                    // transmission
-                    double n = 1 / nearest_obj->refraction;
-                    double d = nearest_normal.x * light_dir.x + nearest_normal.y * light_dir.y + nearest_normal.z * light_dir.z;
-                    Vec3 n1(nearest_normal);
-                    n1.mul(d);
-                    n1.set(light_dir.x - n1.x, light_dir.y - n1.y, light_dir.z - n1.z);
-                    n1.mul(n);
-                    Vec3 n2(nearest_normal);
-                    double s = 1 - (n * n) * (1 - d * d);
-                    n2.mul(sqrt(s));
-                    n1.add(-n2.x, -n2.y, -n2.z);
-                    // n1 is refracted vector
-                    // we should be able to step a tiny part along our refracted ray to avoid
-                    // having to exclude the object we just hit allowing us to hit the otherside
-                    light_source.set(nearest_result.x + n1.x * 0.01, nearest_result.y + n1.y * 0.01, nearest_result.z + n1.z * 0.01);
-                    light_dir.set(n1.x, n1.y, n1.z);
-                    light_dir.normalize();
-                    exclude = nullptr;
-                    continue;
-                } else {
-                    // absorption
-                    photon *next = new photon;
-                    next->x = (float) nearest_result.x;
-                    next->y = (float) nearest_result.y;
-                    next->z = (float) nearest_result.z;
-                    next->power[0] = fastfloor(photon_power.x * 0xFF);
-                    next->power[1] = fastfloor(photon_power.y * 0xFF);
-                    next->power[2] = fastfloor(photon_power.z * 0xFF);
-                    next->power[3] = 255;
-                    next->dx = (float) light_dir.x;
-                    next->dy = (float) light_dir.y;
-                    next->dz = (float) light_dir.z;
-                    next->bounce = bounces;
-                    photons[photon_index++] = next;
-                    //printf("photon %.1f %.1f %.1f\n", next->x, next->y, next->z);
+            }
+        }
+        data->projection->counts[data->patch] = count;
+    }
+
+    // builds the projection map with a job for each patch of the light
+    projection_map *createProjectionMap(Scene *scene) {
+        int32 cell_count = PROJECTION_RESOLUTION * PROJECTION_RESOLUTION;
+        int32 patch_count = PROJECTION_PATCHES * PROJECTION_PATCHES;
+        projection_map *projection = new projection_map;
+        projection->cells = new int32[patch_count * cell_count];
+        projection->counts = new int32[patch_count];
+        projection->cumulative = new int32[patch_count];
+        double *centers = new double[cell_count * 3];
+        double *cell_angles = new double[cell_count];
+        Vec3 center(0, 0, 0);
+        Vec3 corner(0, 0, 0);
+        for (int32 i = 0; i < PROJECTION_RESOLUTION; i++) {
+            for (int32 j = 0; j < PROJECTION_RESOLUTION; j++) {
+                int32 cell = i * PROJECTION_RESOLUTION + j;
+                projectionDirection((i + 0.5) / PROJECTION_RESOLUTION, (j + 0.5) / PROJECTION_RESOLUTION, &center);
+                centers[cell * 3] = center.x;
+                centers[cell * 3 + 1] = center.y;
+                centers[cell * 3 + 2] = center.z;
+                double cell_angle = 0;
+                for (int32 a = 0; a <= 2; a++) {
+                    for (int32 b = 0; b <= 2; b++) {
+                        projectionDirection((i + a * 0.5) / PROJECTION_RESOLUTION, (j + b * 0.5) / PROJECTION_RESOLUTION, &corner);
+                        double d = center.dot(&corner);
+                        double angle = acos(d > 1 ? 1 : d);
+                        cell_angle = angle > cell_angle ? angle : cell_angle;
+                    }
                 }
-                break;
+                cell_angles[cell] = cell_angle;
             }
         }
-        auto end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> duration = (end - start);
-        printf("Global photons traced in %.3fs\n", duration.count());
+        double *bounds = new double[(scene->size > 0 ? scene->size : 1) * 6];
+        int32 bounds_count = 0;
+        Vec3 min(0, 0, 0);
+        Vec3 max(0, 0, 0);
+        for (int32 i = 0; i < scene->size; i++) {
+            SceneObject *object = scene->objects[i];
+            if (object == nullptr || (object->specular_chance <= 0 && object->transmission_chance <= 0)) {
+                continue;
+            }
+            object->bounds(&min, &max);
+            double *next = &bounds[bounds_count++ * 6];
+            next[0] = min.x;
+            next[1] = min.y;
+            next[2] = min.z;
+            next[3] = max.x;
+            next[4] = max.y;
+            next[5] = max.z;
+        }
+        scheduler::JobGroup group;
+        for (int32 patch = 0; patch < patch_count; patch++) {
+            projection_task_data data;
+            data.projection = projection;
+            data.centers = centers;
+            data.cell_angles = cell_angles;
+            data.bounds = bounds;
+            data.bounds_count = bounds_count;
+            data.patch = patch;
+            scheduler::submit(projection_task, data, &group);
+        }
+        scheduler::wait(&group);
+        int32 total = 0;
+        for (int32 patch = 0; patch < patch_count; patch++) {
+            total += projection->counts[patch];
+            projection->cumulative[patch] = total;
+        }
+        delete[] bounds;
+        delete[] centers;
+        delete[] cell_angles;
+        projection->coverage = total / (double) (patch_count * cell_count);
+        return projection;
+    }
 
-        // we just store the photons into an array when calculating them
-        // and then after we have all the photons we can build the kd-tree
-        // which is more efficient that continually trying to balance the kd-tree
-        photon **scratch = new photon*[photon_size];
-        printf("Building global photons kd-tree\n");
-        start = std::chrono::high_resolution_clock::now();
-        kdnode *global_tree = createKDTree(photons, photon_size, scratch, photon_size);
-        end = std::chrono::high_resolution_clock::now();
-        duration = (end - start);
-        printf("Global photons kd-tree built in %.3fs\n", duration.count());
-        delete[] scratch;
-        delete[] photons;
-        return global_tree;
+    void deleteProjectionMap(projection_map *projection) {
+        delete[] projection->cells;
+        delete[] projection->counts;
+        delete[] projection->cumulative;
+        delete projection;
     }
 
-    // builds the caustic photon map
-    // very similar to the global map except we only store photons which have undergone at
-    // least one reflection or transmission
-    kdnode *createCausticPhotonMap(int32 photon_size, Vec3 &light_source, Vec3 &light_color, Scene *scene) {
-        printf("Building caustic photon map from %d photons\n", photon_size);
-        auto start = std::chrono::high_resolution_clock::now();
-        int photon_index = 0;
-        photon **photons = new photon*[photon_size];
+    // the kinds of path a photon can take from the light
+    enum PhotonPath {
+        // the photon left the scene or can't be stored in any map that wants it
+        LOST_PATH,
+        // the photon was absorbed without starting with a specular bounce
+        DIFFUSE_PATH,
+        // the photon was absorbed after starting with a specular reflection or transmission
+        CAUSTIC_PATH
+    };
+
+    // traces a photon from the light until it's absorbed and fills in where it landed
+    // a photon that's only wanted as a caustic stops as soon as it can't become one
+    PhotonPath tracePhoton(Scene *scene, Vec3 &light_source, Vec3 &light_dir, Vec3 &photon_power, bool caustic_only, photon *result, int32 *object) {
         SceneObject *nearest_obj = nullptr;
         Vec3 nearest_result(0, 0, 0);
         Vec3 nearest_normal(0, 0, 0);
+        int bounces = 0;
+        SceneObject *exclude = nullptr;
+        // whether the path so far can still make a caustic, and whether it already has
+        bool caustic = true;
+        bool specular_bounce = false;
+        while (true) {
+            bounces++;
+            // trace photon
+
+            scene->intersect(light_source, light_dir, exclude, &nearest_result, &nearest_normal, &nearest_obj, 0);
+            if (nearest_obj == nullptr) {
+                return LOST_PATH;
+            }
+            // we have a hit time to decide whether to reflect, absorb, or transmit
+            double chance = randutil::nextDouble();
+            if (bounces > 3) {
+                // force an absorption if we've already bounced too many times
+                chance = 1;
+            }
+            if (chance < nearest_obj->diffuse_chance + nearest_obj->specular_chance) {
+                // specular reflection
+                Vec3 n1(nearest_normal);
+                n1.mul(n1.x * light_dir.x + n1.y * light_dir.y + n1.z * light_dir.z);
+                n1.mul(2);
+                light_source.set(nearest_result.x, nearest_result.y, nearest_result.z);
+                light_dir.set(light_dir.x - n1.x, light_dir.y - n1.y, light_dir.z - n1.z);
+                light_dir.normalize();
+                photon_power.mul(nearest_obj->red, nearest_obj->green, nearest_obj->blue);
+                // only the specular part of the reflection makes a caustic, the diffuse part is
+                // also traced as a mirror but a caustic has to start with a specular bounce
+                if (chance >= nearest_obj->diffuse_chance) {
+                    specular_bounce = true;
+                } else if (!specular_bounce) {
+                    caustic = false;
+                    if (caustic_only) {
+                        return LOST_PATH;
+                    }
+                }
+                // exclude the object we just hit from the next search so we don't hit it again
+                exclude = nearest_obj;
+                continue;
+            } else if (chance < nearest_obj->diffuse_chance + nearest_obj->specular_chance + nearest_obj->transmission_chance) {
+                // transmission
+                // Equation from Fundamentals of Computer Graphics 4th edition p 325.
+                double n = 1 / nearest_obj->refraction;
+                double d = nearest_normal.x * light_dir.x + nearest_normal.y * light_dir.y + nearest_normal.z * light_dir.z;
+                Vec3 n1(nearest_normal);
+                n1.mul(d);
+                n1.set(light_dir.x - n1.x, light_dir.y - n1.y, light_dir.z - n1.z);
+                n1.mul(n);
+                Vec3 n2(nearest_normal);
+                double s = 1 - (n * n) * (1 - d * d);
+                n2.mul(sqrt(s));
+                n1.add(-n2.x, -n2.y, -n2.z);
+                // n1 is refracted vector
+                // we should be able to step a tiny part along our refracted ray to avoid
+                // having to exclude the object we just hit allowing us to hit the otherside
+                light_source.set(nearest_result.x + n1.x * 0.01, nearest_result.y + n1.y * 0.01, nearest_result.z + n1.z * 0.01);
+                light_dir.set(n1.x, n1.y, n1.z);
+                light_dir.normalize();
+                specular_bounce = true;
+                exclude = nullptr;
+                continue;
+            }
+            // absorption
+            bool is_caustic = caustic && specular_bounce;
+            if (caustic_only && !is_caustic) {
+                return LOST_PATH;
+            }
+            *object = nearest_obj->index;
+            result->x = (float) nearest_result.x;
+            result->y = (float) nearest_result.y;
+            result->z = (float) nearest_result.z;
+            setPhotonPower(&result->payload, photon_power);
+            setPhotonDirection(&result->payload, light_dir);
+            result->payload.bounce = (uint8) min(bounces, 0xFF);
+            result->payload.unused = 0;
+            return is_caustic ? CAUSTIC_PATH : DIFFUSE_PATH;
+        }
+    }
+
+    // picks a point on the light and a direction from it through a cell of the projection map
+    // every marked cell of every patch is equally likely so the photons follow the light's
+    // distribution limited to the marked cells
+    void projectedEmission(projection_map *projection, Vec3 *light_source, Vec3 *light_dir) {
+        int32 last = PROJECTION_PATCHES * PROJECTION_PATCHES - 1;
+        int32 pick = min((int32) (randutil::nextDouble() * projection->cumulative[last]), projection->cumulative[last] - 1);
+        int32 patch = 0;
+        while (projection->cumulative[patch] <= pick) {
+            patch++;
+        }
+        int32 *cells = &projection->cells[patch * PROJECTION_RESOLUTION * PROJECTION_RESOLUTION];
+        int32 cell = cells[pick - (projection->cumulative[patch] - projection->counts[patch])];
+        double x0 = LIGHT_X + (patch % PROJECTION_PATCHES + randutil::nextDouble()) * LIGHT_SIZE / PROJECTION_PATCHES;
+        double z0 = LIGHT_Z + (patch / PROJECTION_PATCHES + randutil::nextDouble()) * LIGHT_SIZE / PROJECTION_PATCHES;
+        double y0 = LIGHT_Y;
+        light_source->set(x0, y0, z0);
+        double u = (cell / PROJECTION_RESOLUTION + randutil::nextDouble()) / PROJECTION_RESOLUTION;
+        double v = (cell % PROJECTION_RESOLUTION + randutil::nextDouble()) / PROJECTION_RESOLUTION;
+        projectionDirection(u, v, light_dir);
+    }
+
+    // traces photons from the light until this job's slices of the global and caustic photon maps are full
+    // photons are emitted in every direction while the global slice is filling, and any caustics among
+    // them go to both maps, then the rest of the caustic slice is filled through the projection map
+    void photon_task(void *vdata) {
+        photon_task_data *data = (photon_task_data*) vdata;
+        photon_trace_context *context = data->context;
+        randutil::beginStream(randutil::PHOTON_STREAM, data->index, data->pass);
+        int32 start = data->index * PHOTONS_PER_JOB;
+        int32 global_count = min(PHOTONS_PER_JOB, context->global_count - start);
+        int32 caustic_count = min(PHOTONS_PER_JOB, context->caustic_count - start);
+        global_count = global_count > 0 ? global_count : 0;
+        caustic_count = caustic_count > 0 ? caustic_count : 0;
+        int32 global_index = 0;
+        int32 caustic_index = 0;
+        int64 emitted = 0;
+        int64 projected = 0;
+        // a job without a caustic slice throws away every caustic it emits
+        int64 caustic_emitted = caustic_count == 0 ? 0 : -1;
+        int32 projected_caustics = 0;
+        Vec3 &light_color = *context->light_color;
+        Vec3 light_source(0, 0, 0);
+        Vec3 light_dir(0, 0, 0);
         Vec3 photon_power(light_color);
-        while (photon_index < photon_size) {
+        photon next;
+        int32 object;
+        // we keep going until we have the desired number of photons in our maps
+        while (global_index < global_count || caustic_index < caustic_count) {
             photon_power.set(&light_color);
-            double x0 = randutil::nextDouble() * 2 - 1;
-            double z0 = randutil::nextDouble() * 2 + 3;
-            double y0 = 4.95;
-            light_source.set(x0, y0, z0);
-            // direction based on cosine distribution
-            // formula for distribution from https://www.particleincell.com/2015/cosine-distribution/
-            double sin_theta = sqrt(randutil::nextDouble());
-            double cos_theta = sqrt(1 - sin_theta*sin_theta);
-            double psi = randutil::nextDouble() * 6.2831853;
-            // we cheat a little for this scene and angle the light more down beause we know our objects are below the light
-            Vec3 light_dir(sin_theta * cos(psi), -2 * cos_theta, sin_theta * sin(psi));
-            light_dir.normalize();
-            int bounces = 0;
-            bool specular_bounce = false;
-            while (true) {
-                bounces++;
-                // trace photon
-
-                scene->intersect(light_source, light_dir, nullptr, &nearest_result, &nearest_normal, &nearest_obj, 0);
-                if (nearest_obj == nullptr) {
+            bool caustic_only = global_index == global_count;
+            if (caustic_only) {
+                if (projected >= (int64) PROJECTION_MAX_ATTEMPTS * (projected_caustics + 1)) {
                     break;
                 }
-                // we have a hit time to decide whether to reflect, absorb, or transmit
-                double chance = randutil::nextDouble();
-                if (bounces > 3) {
-                    // force an absorption if we've already bounced too many times
-                    chance = 1;
-                }
-                if (chance < nearest_obj->diffuse_chance + nearest_obj->specular_chance) {
-                    // specular reflection
-                    Vec3 n1(nearest_normal);
-                    n1.mul(n1.x * light_dir.x + n1.y * light_dir.y + n1.z * light_dir.z);
-                    n1.mul(2);
-                    light_source.set(nearest_result.x, nearest_result.y, nearest_result.z);
-                    light_dir.set(light_dir.x - n1.x, light_dir.y - n1.y, light_dir.z - n1.z);
-                    light_dir.normalize();
-                    specular_bounce = true;
-                    photon_power.mul(nearest_obj->red, nearest_obj->green, nearest_obj->blue);
-                    continue;
-                } else if (chance < nearest_obj->diffuse_chance + nearest_obj->specular_chance + nearest_obj->transmission_chance) {
-                    // refract
-                    // Equation from Fundamentals of Computer Graphics 4th edition p 325.
-                    double n = 1 / nearest_obj->refraction;
-                    double d = nearest_normal.x * light_dir.x + nearest_normal.y * light_dir.y + nearest_normal.z * light_dir.z;
-                    Vec3 n1(nearest_normal);
-                    n1.mul(d);
-                    n1.set(light_dir.x - n1.x, light_dir.y - n1.y, light_dir.z - n1.z);
-                    n1.mul(n);
-                    Vec3 n2(nearest_normal);
-                    double s = 1 - (n * n) * (1 - d * d);
-                    n2.mul(sqrt(s));
-                    n1.add(-n2.x, -n2.y, -n2.z);
-                    // n1 is refracted vector
-                    // we should be able to step a tiny part along our refracted ray to avoid
-                    // having to exclude the object we just hit allowing us to hit the otherside
-                    light_source.set(nearest_result.x + n1.x * 0.01, nearest_result.y + n1.y * 0.01, nearest_result.z + n1.z * 0.01);
-                    light_dir.set(n1.x, n1.y, n1.z);
-                    light_dir.normalize();
-                    specular_bounce = true;
-                    continue;
-                } else {
-                    if (!specular_bounce) {
-                        // not a caustic, skip and try again
-                        break;
-                    }
-                    // absorption
-                    photon *next = new photon;
-                    next->x = (float) nearest_result.x;
-                    next->y = (float) nearest_result.y;
-                    next->z = (float) nearest_result.z;
-                    next->power[0] = fastfloor(photon_power.x * 0xFF);
-                    next->power[1] = fastfloor(photon_power.y * 0xFF);
-                    next->power[2] = fastfloor(photon_power.z * 0xFF);
-                    next->power[3] = 255;
-                    next->dx = (float) light_dir.x;
-                    next->dy = (float) light_dir.y;
-                    next->dz = (float) light_dir.z;
-                    next->bounce = bounces;
-                    photons[photon_index++] = next;
-                    //printf("photon %.1f %.1f %.1f\n", next->x, next->y, next->z);
+                projected++;
+                projectedEmission(context->projection, &light_source, &light_dir);
+            } else {
+                emitted++;
+                double x0 = randutil::nextDouble() * LIGHT_SIZE + LIGHT_X;
+                double z0 = randutil::nextDouble() * LIGHT_SIZE + LIGHT_Z;
+                double y0 = LIGHT_Y;
+                light_source.set(x0, y0, z0);
+                // direction based on cosine distribution
+                double u = randutil::nextDouble();
+                double v = randutil::nextDouble();
+                projectionDirection(u, v, &light_dir);
+            }
+            PhotonPath path = tracePhoton(context->scene, light_source, light_dir, photon_power, caustic_only, &next, &object);
+            if (path == LOST_PATH) {
+                continue;
+            }
+            if (!caustic_only) {
+                context->global_photons[start + global_index] = next;
+                context->global_objects[start + global_index] = object;
+                global_index++;
+            }
+            // a caustic is spread the same whichever way it was emitted so they can share the slice
+            if (path == CAUSTIC_PATH && caustic_index < caustic_count) {
+                context->caustic_photons[start + caustic_index] = next;
+                context->caustic_objects[start + caustic_index] = object;
+                caustic_index++;
+                if (caustic_only) {
+                    projected_caustics++;
+                } else if (caustic_index == caustic_count) {
+                    caustic_emitted = emitted;
                 }
-                break;
             }
         }
+        photon_job_counts *counts = &context->counts[data->index];
+        counts->emitted = emitted;
+        counts->projected = projected;
+        counts->caustic_emitted = caustic_emitted < 0 ? emitted : caustic_emitted;
+        counts->caustics = caustic_index;
+    }
+
+    // traces the photons for the global and caustic maps in one pass and builds the maps
+    void createPhotonMaps(int32 global_count, int32 caustic_count, Vec3 &light_color, Scene *scene, photon_map_options *options, int32 pass, photon_map **global_map, photon_map **caustic_map) {
+        initPhotonTables();
+        printf("Building photon maps from %d global and %d caustic photons\n", global_count, caustic_count);
+        auto start = std::chrono::high_resolution_clock::now();
+        photon_trace_context context;
+        context.light_color = &light_color;
+        context.scene = scene;
+        context.projection = nullptr;
+        if (caustic_count > 0) {
+            context.projection = createProjectionMap(scene);
+            if (context.projection->coverage == 0) {
+                // nothing can make a caustic so there's no point tracing any caustic photons
+                caustic_count = 0;
+            }
+        }
+        context.global_count = global_count;
+        context.caustic_count = caustic_count;
+        context.global_photons = new photon[global_count > 0 ? global_count : 1];
+        context.global_objects = new int32[global_count > 0 ? global_count : 1];
+        context.caustic_photons = new photon[caustic_count > 0 ? caustic_count : 1];
+        context.caustic_objects = new int32[caustic_count > 0 ? caustic_count : 1];
+        // the photons are traced in parallel with each job filling its own slice of the photon arrays
+        // so that we end up with exactly the requested number of photons, unless a job gives up on the caustics
+        int32 largest = global_count > caustic_count ? global_count : caustic_count;
+        int32 job_count = (largest + PHOTONS_PER_JOB - 1) / PHOTONS_PER_JOB;
+        context.counts = new photon_job_counts[job_count > 0 ? job_count : 1];
+        scheduler::JobGroup group;
+        for (int32 i = 0; i < job_count; i++) {
+            photon_task_data data;
+            data.index = i;
+            data.pass = pass;
+            data.context = &context;
+            scheduler::submit(photon_task, data, &group);
+        }
+        scheduler::wait(&group);
+        int64 emitted = 0;
+        int64 projected = 0;
+        int64 caustic_emitted = 0;
+        int32 caustics = 0;
+        for (int32 i = 0; i < job_count; i++) {
+            photon_job_counts *counts = &context.counts[i];
+            emitted += counts->emitted;
+            projected += counts->projected;
+            caustic_emitted += counts->caustic_emitted;
+            // close up the gaps left by any job that gave up filling its slice
+            int32 start = i * PHOTONS_PER_JOB;
+            for (int32 j = 0; j < counts->caustics; j++) {
+                context.caustic_photons[caustics + j] = context.caustic_photons[start + j];
+                context.caustic_objects[caustics + j] = context.caustic_objects[start + j];
+            }
+            caustics += counts->caustics;
+        }
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> duration = (end - start);
-        printf("Caustic photons traced in %.3fs\n", duration.count());
+        printf("Photons traced in %.3fs, %lld emitted in every direction and %lld through the caustic projection map\n", duration.count(), (long long) emitted, (long long) projected);
+        if (context.projection != nullptr) {
+            // a caustic has to start by hitting one of the objects the projection map marks, so each photon
+            // emitted through the map stands for 1 / coverage photons emitted in every direction
+            double equivalent = caustic_emitted + projected / context.projection->coverage;
+            printf("Caustic projection map covers %.1f%% of the light, %.0f photons would be emitted for the caustics without it\n",
+                context.projection->coverage * 100, equivalent);
+            if (caustics < caustic_count) {
+                printf("Only %d caustic photons were found through the projection map\n", caustics);
+                caustic_count = caustics;
+            }
+            // the global photons carry the light's power shared over the photons emitted for them, so the
+            // caustics carry it shared over the photons they stand for, however many had to be projected
+            if (emitted > 0 && equivalent > 0) {
+                double scale = emitted / equivalent;
+                Vec3 power(0, 0, 0);
+                double channels[3];
+                for (int32 i = 0; i < caustic_count; i++) {
+                    photon_payload *p = &context.caustic_photons[i].payload;
+                    photonPower(p, channels);
+                    power.set(channels[0] * scale, channels[1] * scale, channels[2] * scale);
+                    setPhotonPower(p, power);
+                }
+            }
+            deleteProjectionMap(context.projection);
+        }
 
-        // process photons
-        photon **scratch = new photon*[photon_size];
-        printf("Building caustic photon kd-tree\n");
+        // we just store the photons into an array when calculating them
+        // and then after we have all the photons we can build the indexes
+        // which is more efficient that continually trying to balance a kd-tree
+        printf("Building photon indexes\n");
         start = std::chrono::high_resolution_clock::now();
-        kdnode *caustic_tree = createKDTree(photons, photon_size, scratch, photon_size);
+        if (global_map != nullptr) {
+            *global_map = createObjectMaps(context.global_photons, context.global_objects, global_count, scene->size, options->global_backend, options->global_k, options->global_aggregates);
+        }
+        if (caustic_map != nullptr) {
+            *caustic_map = createObjectMaps(context.caustic_photons, context.caustic_objects, caustic_count, scene->size, options->caustic_backend, options->caustic_k, false);
+        }
         end = std::chrono::high_resolution_clock::now();
         duration = (end - start);
-        printf("Caustic photons kd-tree built in %.3fs\n", duration.count());
-        delete[] scratch;
-        delete[] photons;
-        return caustic_tree;
+        printf("Photon indexes built in %.3fs\n", duration.count());
+        delete[] context.global_photons;
+        delete[] context.global_objects;
+        delete[] context.caustic_photons;
+        delete[] context.caustic_objects;
+        delete[] context.counts;
     }
 
-    // recursively deletes the tree and its children
-    void deleteTree(kdnode *tree) {
-        if (tree->left != nullptr) {
-            deleteTree(tree->left);
+    void deletePhotonMap(photon_map *map) {
+        for (int32 i = 0; i < map->count; i++) {
+            delete map->indexes[i];
+            if (map->irradiance != nullptr) {
+                delete map->irradiance[i];
+            }
         }
-        if (tree->right != nullptr) {
-            deleteTree(tree->right);
+        delete[] map->indexes;
+        delete[] map->irradiance;
+        if (map->file != nullptr) {
+            closeMappedFile(map->file);
         }
-        delete tree->value;
-        delete tree;
+        delete map;
     }
 }
@@ -3,30 +3,204 @@
 #include "Vector.h"
 #include "Scene.h"
 
+// The max number of photons in a leaf of the kd-tree, must be a multiple of 4
+#define KD_BUCKET_SIZE 16
+// The square light the photons leave from, facing down at a height of LIGHT_Y and covering LIGHT_SIZE
+// from LIGHT_X along x and from LIGHT_Z along z
+#define LIGHT_X -1.0
+#define LIGHT_Y 4.95
+#define LIGHT_Z 3.0
+#define LIGHT_SIZE 2.0
+// The number of indexes a gather cache remembers the last gather of
+#define GATHER_CACHE_SIZE 8
+
 namespace raytrace {
 
+    // Everything about a photon but its position packed into 8 bytes, so an index which keeps the
+    // positions on their own doesn't store them twice
+    struct photon_payload {
+        // the red, green and blue power sharing the exponent in the 4th byte
+        uint8 power[4];
+        // the incoming direction quantized to spherical angles
+        uint8 theta, phi;
+        // the number of bounces before the photon was stored
+        uint8 bounce;
+        // pads the payload to 8 bytes, always 0
+        uint8 unused;
+    };
+
+    // A photon packed into 20 bytes
     struct photon {
         float x, y, z;
-        uint8 power[4];
-        float dx, dy, dz;
-        int8 bounce;
+        photon_payload payload;
+    };
+
+    // fills the tables photonDirection decodes the angles with, called before any photon map is made
+    void initPhotonTables();
+    void setPhotonPower(photon_payload *p, Vec3 &power);
+    void photonPower(photon_payload *p, double *result);
+    void setPhotonDirection(photon_payload *p, Vec3 &direction);
+    void photonDirection(photon_payload *p, Vec3 *result);
+
+    // A plane splitting the photons of a kd-tree node
+    struct kdsplit {
+        float value;
+        int32 axis;
+    };
+
+    // The photons below a node of a kd-tree summed up so that a rough estimate can use the node instead
+    // of gathering its photons, in the spirit of "Lightcuts" by Walter et al.
+    struct kdaggregate {
+        int32 count;
+        float min[3];
+        float max[3];
+        // the power of each channel summed as a vector against the photons' incoming directions, so the
+        // power arriving at a surface scaled by the cosine is the dot product with its normal
+        float flux[3][3];
+        // the bounds of every photon's incoming direction
+        float direction_min[3];
+        float direction_max[3];
+    };
+
+    // The k nearest photons found by a search, small k are kept sorted by distance while
+    // larger k are kept in a max-heap
+    struct photon_gather {
+        photon_payload **payloads;
+        // the squared distance to each photon
+        double *distances;
+        // the largest k this can gather
+        int32 capacity;
+        int32 k;
+        int32 size;
+    };
+
+    photon_gather *createGather(int32 capacity);
+    void deleteGather(photon_gather *gather);
+    void beginGather(photon_gather *gather, int32 k);
+    void gatherPhoton(photon_gather *gather, photon_payload *next, double dist);
+    double gatherRadius(photon_gather *gather);
+
+    // The kinds of structure a photon map can use to find the photons near a point
+    enum PhotonBackend {
+        KD_TREE_BACKEND,
+        HASH_GRID_BACKEND
+    };
+
+    // An abstract class for a structure over a set of photons which finds the nearest ones to a point
+    class PhotonIndex {
+    public:
+        virtual ~PhotonIndex() {}
+
+        // gathers the nearest photons whose squared distance from the target is less than
+        // max_dist and returns how many were gathered
+        virtual int findNearest(photon_gather *gather, Vec3 *target, double max_dist) = 0;
+        // estimates the irradiance at the target from a group of at least k photons around it without
+        // gathering them, returning false if there is no group within max_radius the estimate works for
+        virtual bool coarseIrradiance(Vec3 *, Vec3 *, int32, double, double *) { return false; }
+        // copies out the photon at the given index in the order the index stores them
+        virtual void getPhoton(int32 i, photon *result) = 0;
+
+        int32 size;
+        // whether the index allocated its arrays, or they point into memory owned by something
+        // else such as a mapped cache file
+        bool owned;
+    };
+
+    // A balanced kd-tree of photons which stops splitting once the photons fit in a bucket
+    // the splits are stored implicitly with the children of the node at index i at 2i + 1 and
+    // 2i + 2, the nodes past the last split are the buckets
+    class KDTree : public PhotonIndex {
+    public:
+        KDTree(photon *source, int32 count);
+        // wraps a tree that was already built without taking ownership of its arrays
+        KDTree(photon_payload *payloads, int32 count, int32 depth, kdsplit *splits, int32 *buckets, float *positions, kdaggregate *aggregates);
+        ~KDTree();
+
+        int findNearest(photon_gather *gather, Vec3 *target, double max_dist) override;
+        bool coarseIrradiance(Vec3 *target, Vec3 *normal, int32 k, double max_radius, double *result) override;
+        void getPhoton(int32 i, photon *result) override;
+        // sums up the photons below each split into its aggregate, coarse estimates need this first
+        void aggregate();
+
+        // the number of levels of splits, there are 2^depth buckets
+        int32 depth;
+        kdsplit *splits;
+        // the index of the first photon of each bucket, plus one past the end
+        int32 *buckets;
+        // the photons without their positions in bucket order
+        photon_payload *payloads;
+        // the positions of the photons, with each bucket's x coordinates then y then z starting at
+        // 3 times its first photon's index for testing a whole bucket at once
+        // a bucket is always read KD_BUCKET_SIZE at a time so KD_BUCKET_SIZE more are kept past the end
+        float *positions;
+        // the photons below each split, or null if they haven't been summed up
+        kdaggregate *aggregates;
+    };
+
+    int find_nearest_photons(photon_gather *gather, Vec3 *target, PhotonIndex *index, double max_dist);
+
+    // The last full gather from one index
+    struct gather_cache_entry {
+        PhotonIndex *index;
+        int32 k;
+        double max_dist;
+        double x, y, z;
+        // the distance to the farthest photon it gathered
+        double radius;
+        // when the entry was last used, the least recently used entry makes room for a new index
+        uint32 used;
+    };
+
+    // Remembers the last gather from each index so that a gather near it, like the next sample of
+    // a pixel, can start searching with a tight radius instead of the max distance
+    // the k nearest photons are always within the last radius plus the distance moved, so the
+    // photons found are the same as without the cache
+    struct gather_cache {
+        gather_cache_entry entries[GATHER_CACHE_SIZE];
+        // counts up each time an entry is used
+        uint32 clock;
+    };
+
+    gather_cache *createGatherCache();
+    void deleteGatherCache(gather_cache *cache);
+    // finds the nearest photons like find_nearest_photons but through the cache, which can be null
+    int findNearestCached(gather_cache *cache, photon_gather *gather, Vec3 *target, PhotonIndex *index, double max_dist);
+    void showPhotons(uint32 *pane, PhotonIndex *index);
+
+    struct mapped_file;
+
+    // The photons of a scene with a separate index for the photons on each object, so a gather
+    // only searches the surface it's for
+    struct photon_map {
+        // the index for each object indexed by SceneObject::index
+        PhotonIndex **indexes;
+        // the kd-trees of precomputed irradiance for each object, or null if it hasn't been precomputed
+        PhotonIndex **irradiance;
+        int32 count;
+        PhotonBackend backend;
+        // the cache file the indexes point into, or null if they were built in memory
+        mapped_file *file;
     };
 
-    struct kdnode {
-        photon *value;
-        kdnode *left;
-        kdnode *right;
-        Axis splitting_axis;
+    // How the photon maps are searched, the number of photons each gather will want is used to size
+    // the hash grid cells
+    struct photon_map_options {
+        PhotonBackend global_backend;
+        int32 global_k;
+        PhotonBackend caustic_backend;
+        int32 caustic_k;
+        // whether the global map's kd-trees sum up the photons below each split for coarse estimates
+        bool global_aggregates;
     };
 
-    photon *findMedianPhoton(photon** photons, int size, Axis axis);
-    kdnode *createKDTree(photon **photons, int size, photon **scratch, int scratch_size);
-    void insert(photon **nearest, double *distances, int k, int size, photon *next, double dist);
-    int find_nearest_photons(photon **nearest, double *distances, int k, int size, Vec3 *target, kdnode *root, double max_dist);
-    void showPhotons(uint32 *pane, kdnode *tree);
+    // traces the photons of the global and caustic maps in a single pass and builds the maps, either map
+    // can be null if it isn't wanted as long as its count is 0
+    // each pass of a progressive render traces a different set of photons
+    void createPhotonMaps(int32 global_count, int32 caustic_count, Vec3 &light_color, Scene *scene, photon_map_options *options, int32 pass, photon_map **global_map, photon_map **caustic_map);
 
-    kdnode *createPhotonMap(int32 photon_count, Vec3 &light_source, Vec3 &light_color, Scene *scene);
-    kdnode *createCausticPhotonMap(int32 photon_count, Vec3 &light_source, Vec3 &light_color, Scene *scene);
+    void estimateIrradiance(photon_gather *gather, gather_cache *cache, PhotonIndex *index, int32 k, Vec3 *point, Vec3 *normal, double max_dist, double *result);
+    void precomputeIrradiance(photon_map *map, Scene *scene, int32 k, double max_dist);
+    void lookupIrradiance(photon_gather *gather, PhotonIndex *index, Vec3 *point, double max_dist, double *result);
 
-    void deleteTree(kdnode *tree);
+    void deletePhotonMap(photon_map *map);
 }
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include "Progressive.h"
+
+#include <cstdio>
+#include <chrono>
+#include <cmath>
+
+#include "JobSystem.h"
+
+// The fraction of the new photons kept at each pass, from the progressive photon mapping paper
+#define SPPM_ALPHA 0.7
+// The squared radius each pixel starts gathering photons from
+#define SPPM_INITIAL_RADIUS 0.25
+// The max number of photons a pixel gathers in one pass, the radius shrinks to fit if there are more
+#define SPPM_MAX_GATHER 512
+// The max number of specular bounces followed from the camera
+#define SPPM_MAX_BOUNCES 3
+// The number of rows of pixels handled by each job
+#define SPPM_ROWS_PER_JOB 8
+// The indirect light is scaled to match the brightness of the photon map estimate in traceRay,
+// which spreads this many photons with a cone filter
+#define SPPM_REFERENCE_PHOTONS 2048
+
+#define PI 3.141592653589793
+
+namespace raytrace {
+
+    // data shared by all of the progressive render jobs
+    struct sppm_context {
+        int32 width;
+        int32 height;
+        int32 pass;
+        sppm_pixel *pixels;
+        float *pane;
+        Scene *scene;
+        photon_map *photons;
+        // the total number of photons traced over every pass so far
+        double emitted;
+        Vec3 *light_color;
+        Vec3 *camera;
+    };
+
+    // data used by each job
+    struct sppm_task_data {
+        sppm_context *context;
+        int32 start_y;
+        int32 end_y;
+    };
+
+    // traces a camera ray through the pixel until it lands on a diffuse surface, picking one of
+    // the reflection, transmission or absorption at random at each hit
+    void findVisiblePoint(sppm_context *context, int32 x, int32 y, sppm_pixel *pixel) {
+        randutil::beginStream(randutil::PIXEL_STREAM, x + y * context->width, context->pass);
+        Vec3 *camera = context->camera;
+        double fov = (context->width / 1280.0) * 64.0;
+        double x0 = (x - context->width / 2 + randutil::nextDouble()) / fov - camera->x;
+        double y0 = (y - context->height / 2 + randutil::nextDouble()) / fov - camera->y;
+        Vec3 ray(x0, y0, -camera->z);
+        ray.normalize();
+        Vec3 ray_source(camera);
+        Vec3 nearest_result(0, 0, 0);
+        Vec3 nearest_normal(0, 0, 0);
+        SceneObject *nearest_obj = nullptr;
+        SceneObject *exclude = nullptr;
+        double weight = 1;
+        pixel->object = -1;
+        for (int bounce = 0; bounce <= SPPM_MAX_BOUNCES; bounce++) {
+            context->scene->intersect(ray_source, ray, exclude, &nearest_result, &nearest_normal, &nearest_obj, randutil::nextDouble());
+            if (nearest_obj == nullptr) {
+                return;
+            }
+            if (hitLight(nearest_result)) {
+                Vec3 *light_color = context->light_color;
+                pixel->direct[0] += weight * min(fastfloor(light_color->x * 0xFF) + 50, 0xFF) / 255.0;
+                pixel->direct[1] += weight * min(fastfloor(light_color->y * 0xFF) + 50, 0xFF) / 255.0;
+                pixel->direct[2] += weight * min(fastfloor(light_color->z * 0xFF) + 50, 0xFF) / 255.0;
+                return;
+            }
+            // the chances are treated as a probability so only one path is followed, scaling by
+            // their total keeps the result the same on average as traceRay's weighted sum
+            double total = nearest_obj->absorb_chance + nearest_obj->specular_chance + nearest_obj->transmission_chance;
+            weight *= total;
+            double chance = randutil::nextDouble() * total;
+            if (chance < nearest_obj->absorb_chance) {
+                // a diffuse surface so this is the pixel's visible point
+                pixel->x = (float) nearest_result.x;
+                pixel->y = (float) nearest_result.y;
+                pixel->z = (float) nearest_result.z;
+                pixel->nx = (float) nearest_normal.x;
+                pixel->ny = (float) nearest_normal.y;
+                pixel->nz = (float) nearest_normal.z;
+                pixel->object = nearest_obj->index;
+                pixel->weight[0] = (float) (weight * nearest_obj->red);
+                pixel->weight[1] = (float) (weight * nearest_obj->green);
+                pixel->weight[2] = (float) (weight * nearest_obj->blue);
+                Vec3 shadow_ray(0, 0, 0);
+                int32 light_count = castShadowRays(context->scene, nearest_result, nearest_obj, &shadow_ray);
+                double direct = directLight(nearest_normal, shadow_ray, light_count);
+                pixel->direct[0] += pixel->weight[0] * direct;
+                pixel->direct[1] += pixel->weight[1] * direct;
+                pixel->direct[2] += pixel->weight[2] * direct;
+                return;
+            } else if (chance < nearest_obj->absorb_chance + nearest_obj->specular_chance) {
+                // specular reflection
+                Vec3 n1(nearest_normal);
+                n1.mul(n1.x * ray.x + n1.y * ray.y + n1.z * ray.z);
+                n1.mul(2);
+                ray_source.set(nearest_result.x, nearest_result.y, nearest_result.z);
+                ray.set(ray.x - n1.x, ray.y - n1.y, ray.z - n1.z);
+                ray.normalize();
+                exclude = nearest_obj;
+            } else {
+                // refraction
+                // Equation from Fundamentals of Computer Graphics 4th edition p 325.
+                double n = 1 / nearest_obj->refraction;
+                double d = nearest_normal.x * ray.x + nearest_normal.y * ray.y + nearest_normal.z * ray.z;
+                Vec3 n1(nearest_normal);
+                n1.mul(d);
+                n1.set(ray.x - n1.x, ray.y - n1.y, ray.z - n1.z);
+                n1.mul(n);
+                Vec3 n2(nearest_normal);
+                double s = 1 - (n * n) * (1 - d * d);
+                n2.mul(sqrt(s));
+                n1.add(-n2.x, -n2.y, -n2.z);
+                ray_source.set(nearest_result.x + n1.x * 0.01, nearest_result.y + n1.y * 0.01, nearest_result.z + n1.z * 0.01);
+                ray.set(n1.x, n1.y, n1.z);
+                ray.normalize();
+                exclude = nullptr;
+            }
+        }
+    }
+
+    void visible_point_task(void *vdata) {
+        sppm_task_data *data = (sppm_task_data*) vdata;
+        sppm_context *context = data->context;
+        for (int32 y = data->start_y; y < data->end_y; y++) {
+            for (int32 x = 0; x < context->width; x++) {
+                findVisiblePoint(context, x, y, &context->pixels[x + y * context->width]);
+            }
+        }
+    }
+
+    // gathers this pass's photons into each pixel's visible point, shrinks the radius and writes
+    // the current estimate to the pane
+    void gather_task(void *vdata) {
+        sppm_task_data *data = (sppm_task_data*) vdata;
+        sppm_context *context = data->context;
+        photon_gather *gather = createGather(SPPM_MAX_GATHER);
+        Vec3 point(0, 0, 0);
+        Vec3 normal(0, 0, 0);
+        Vec3 direction(0, 0, 0);
+        double power[3];
+        for (int32 y = data->start_y; y < data->end_y; y++) {
+            for (int32 x = 0; x < context->width; x++) {
+                sppm_pixel *pixel = &context->pixels[x + y * context->width];
+                if (pixel->object >= 0) {
+                    point.set(pixel->x, pixel->y, pixel->z);
+                    normal.set(pixel->nx, pixel->ny, pixel->nz);
+                    beginGather(gather, SPPM_MAX_GATHER);
+                    int found = find_nearest_photons(gather, &point, context->photons->indexes[pixel->object], pixel->radius);
+                    if (found == SPPM_MAX_GATHER) {
+                        // too many photons to gather them all so shrink the radius to the ones we have
+                        // assuming the density was even across the old radius
+                        double shrink = gatherRadius(gather) / pixel->radius;
+                        pixel->radius *= shrink;
+                        pixel->count *= shrink;
+                        for (int i = 0; i < 3; i++) {
+                            pixel->flux[i] *= shrink;
+                        }
+                    }
+                    if (found > 0) {
+                        double flux[3] = { 0, 0, 0 };
+                        for (int i = 0; i < found; i++) {
+                            photon_payload *ph = gather->payloads[i];
+                            photonDirection(ph, &direction);
+                            double d = -normal.dot(&direction);
+                            if (d <= 0) {
+                                continue;
+                            }
+                            photonPower(ph, power);
+                            flux[0] += d * power[0];
+                            flux[1] += d * power[1];
+                            flux[2] += d * power[2];
+                        }
+                        // only keep a fraction of the new photons and shrink the radius to match
+                        double count = pixel->count + SPPM_ALPHA * found;
+                        double ratio = count / (pixel->count + found);
+                        pixel->radius *= ratio;
+                        pixel->count = count;
+                        for (int i = 0; i < 3; i++) {
+                            pixel->flux[i] = (pixel->flux[i] + pixel->weight[i] * flux[i]) * ratio;
+                        }
+                    }
+                }
+                // the cone filter used by traceRay averages to a third over the gather area
+                double scale = SPPM_REFERENCE_PHOTONS / (6 * PI * pixel->radius * context->emitted);
+                float *result = &context->pane[(x + y * context->width) * 3];
+                for (int i = 0; i < 3; i++) {
+                    result[i] = (float) (pixel->direct[i] / (context->pass + 1) + pixel->flux[i] * scale);
+                }
+            }
+        }
+        deleteGather(gather);
+    }
+
+    void runPass(sppm_context *context, scheduler::task job) {
+        scheduler::JobGroup group;
+        for (int32 y = 0; y < context->height; y += SPPM_ROWS_PER_JOB) {
+            sppm_task_data data;
+            data.context = context;
+            data.start_y = y;
+            data.end_y = min(y + SPPM_ROWS_PER_JOB, context->height);
+            scheduler::submit(job, data, &group);
+        }
+        scheduler::wait(&group);
+    }
+
+    void renderProgressive(Scene *scene, Vec3 &camera, float *pane, int32 width, int32 height, render_settings *settings, Vec3 &light_color) {
+        printf("Rendering scene progressively over %d passes of %d photons\n", settings->progressive_passes, settings->photons_per_pass);
+        auto start = std::chrono::high_resolution_clock::now();
+        sppm_context context;
+        context.width = width;
+        context.height = height;
+        context.pixels = new sppm_pixel[width * height];
+        context.pane = pane;
+        context.scene = scene;
+        context.emitted = 0;
+        context.light_color = &light_color;
+        context.camera = &camera;
+        for (int32 i = 0; i < width * height; i++) {
+            sppm_pixel *pixel = &context.pixels[i];
+            pixel->radius = SPPM_INITIAL_RADIUS;
+            pixel->count = 0;
+            for (int j = 0; j < 3; j++) {
+                pixel->flux[j] = 0;
+                pixel->direct[j] = 0;
+            }
+        }
+        photon_map_options options;
+        options.global_backend = KD_TREE_BACKEND;
+        options.global_k = SPPM_MAX_GATHER;
+        options.caustic_backend = KD_TREE_BACKEND;
+        options.caustic_k = SPPM_MAX_GATHER;
+        options.global_aggregates = false;
+        for (int32 pass = 0; pass < settings->progressive_passes; pass++) {
+            context.pass = pass;
+            runPass(&context, visible_point_task);
+            // the photons only live for one pass
+            createPhotonMaps(settings->photons_per_pass, 0, light_color, scene, &options, pass, &context.photons, nullptr);
+            context.emitted += settings->photons_per_pass;
+            runPass(&context, gather_task);
+            deletePhotonMap(context.photons);
+            std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+            printf("Pass %d of %d done after %.3fs\n", pass + 1, settings->progressive_passes, duration.count());
+        }
+        delete[] context.pixels;
+    }
+
+}
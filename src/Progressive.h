@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Vector.h"
+#include "Scene.h"
+#include "Raytrace.h"
+
+namespace raytrace {
+
+    // The progress of a single pixel in a progressive render
+    struct sppm_pixel {
+        // the visible point found by this pass's camera ray, or an object of -1 if there is none
+        float x, y, z;
+        float nx, ny, nz;
+        int32 object;
+        // the color the light reaching the visible point is scaled by
+        float weight[3];
+        // the squared radius photons are gathered from
+        double radius;
+        // the photon count and the flux gathered within the radius over every pass
+        double count;
+        double flux[3];
+        // the sum of the direct light found by each pass
+        double direct[3];
+    };
+
+    // renders the scene with stochastic progressive photon mapping
+    // each pass traces a new batch of photons which is thrown away once the pixels have gathered from it,
+    // so memory only depends on the image size and the image keeps improving with more passes
+    void renderProgressive(Scene *scene, Vec3 &camera, float *pane, int32 width, int32 height, render_settings *settings, Vec3 &light_color);
+
+}
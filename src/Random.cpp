@@ -1,29 +1,55 @@
-
 #include "Random.h"
 
-#include <random>
+// Random numbers are generated from a counter based generator so that each stream is entirely
+// determined by its key and renders are reproducible no matter which thread runs which work.
+// The i-th number of a stream is the SplitMix64 hash of key + i * golden ratio.
+// http://xoshiro.di.unimi.it/splitmix64.c
+#define GOLDEN_GAMMA 0x9E3779B97F4A7C15ULL
 
 namespace randutil {
 
-    std::default_random_engine *rand_engine = new std::default_random_engine;
-    std::uniform_real_distribution<double> *real_dist;
+    uint64 seed_key = 0;
+    // each thread has its own current stream so workers never share any generator state
+    thread_local uint64 stream_key = 0;
+    thread_local uint64 stream_counter = 0;
+
+    // the SplitMix64 finalizer
+    uint64 mix(uint64 z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64 nextBits() {
+        return mix(stream_key + (++stream_counter) * GOLDEN_GAMMA);
+    }
 
     // sets up the random source with the given seed
+    // the calling thread continues with a stream based only on the seed
     void init(int64 seed) {
-        int32 s = (int32) ((((uint64) seed) >> 32) ^ seed);
-        rand_engine->seed(s);
-        real_dist = new std::uniform_real_distribution<double>(0, 1);
+        seed_key = mix((uint64) seed);
+        stream_key = seed_key;
+        stream_counter = 0;
+    }
+
+    // switches the calling thread to the stream for the given piece of work, for example a single
+    // sample of a pixel, the same work always gets the same numbers for a given seed
+    void beginStream(StreamType type, uint64 index, uint64 sample) {
+        stream_key = mix(seed_key ^ mix(((uint64) type) ^ mix(index ^ mix(sample))));
+        stream_counter = 0;
     }
 
-    // gets an integer in the range of 0 (inclusive) and max (exclusive)
+    // gets an integer in the range of min (inclusive) and max (exclusive)
     int32 nextInt(int32 min, int32 max) {
-        std::uniform_int_distribution<int> unif(min, max - 1);
-        return unif(*rand_engine);
+        // maps 32 random bits onto the range with a multiply rather than a modulo
+        uint64 range = (uint64) (max - min);
+        return min + (int32) (((nextBits() >> 32) * range) >> 32);
     }
 
     // gets a double in the range of 0 and 1
     double nextDouble() {
-        return (*real_dist)(*rand_engine);
+        // the top 53 bits fill the mantissa of a double in [0, 1)
+        return (nextBits() >> 11) * (1.0 / 9007199254740992.0);
     }
 
-}
\ No newline at end of file
+}
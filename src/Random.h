@@ -4,10 +4,18 @@
 
 namespace randutil {
 
+    // the kinds of work that use random numbers, each kind gets its own independent set of streams
+    enum StreamType {
+        PIXEL_STREAM,
+        PHOTON_STREAM,
+    };
+
     void init(int64 seed);
 
+    void beginStream(StreamType type, uint64 index, uint64 sample);
+
     int nextInt(int32 min, int32 max);
 
     double nextDouble();
 
-}
\ No newline at end of file
+}
@@ -6,30 +6,80 @@
 #include <cmath>
 
 #include "JobSystem.h"
+#include "Progressive.h"
+#include "PhotonCache.h"
 
 // The number of photons in the global photon map
 #define NUM_PHOTONS 2048
 // The max radius to select photons from
 #define MAX_PHOTON_RADIUS 100
-// The max number of photons to gather
-// must be a power of two minus one for the max-heap to function properly
+// The default number of photons to gather
 #define PHOTONS_IN_ESTIMATE 63
 
 // The number of photons in the caustic photon map
 #define CAUSTIC_PHOTONS 2048
-// The max number of caustic photons to gather
+// The default number of caustic photons to gather
 #define CAUSTIC_PHOTONS_IN_ESTIMATE 63
 
+// The default number of photons traced in each progressive pass
+#define PHOTONS_PER_PASS 2048
+
 // The number of shadow rays to use to sample direct lighting
 #define SHADOW_RAY_COUNT 25
 
 // Max amount of bounces to compute
 #define MAX_BOUNCES 3
 
+// The width and height in pixels of the tiles the image is split into for rendering
+#define TILE_SIZE 16
+// A coarse estimate can use a kd-tree node whose radius is at most this fraction of its distance
+// from the ray's origin, so the nodes used look small from where they're seen
+#define COARSE_MAX_ANGLE 0.5
+
 namespace raytrace {
 
+    // whether the point is on the light source
+    // @TODO: don't hardcode this?
+    bool hitLight(Vec3 &point) {
+        return point.y > 4.95 && point.x > -1 && point.x < 1 && point.z > 3 && point.z < 5;
+    }
+
+    // casts SHADOW_RAY_COUNT rays from the point towards the light and returns how many of them
+    // are in shadow, the last ray cast is written to shadow_ray
+    int32 castShadowRays(Scene *scene, Vec3 &point, SceneObject *object, Vec3 *shadow_ray) {
+        int32 light_count = 0;
+        Vec3 light_source(0, 0, 0);
+        for (int i = 0; i < SHADOW_RAY_COUNT; i++) {
+            // our light is a square so for each shadow ray we send it towards a random point
+            // on the light to get a softer shadow
+            double x0 = randutil::nextDouble() * LIGHT_SIZE + LIGHT_X;
+            double z0 = randutil::nextDouble() * LIGHT_SIZE + LIGHT_Z;
+            double y0 = LIGHT_Y;
+            light_source.set(x0, y0, z0);
+            shadow_ray->set(light_source.x - point.x, light_source.y - point.y, light_source.z - point.z);
+            double max_dist = shadow_ray->length();
+            shadow_ray->normalize();
+            double dt = randutil::nextDouble();
+            // keep track of every ray that hit something in front of the light and is in shadow
+            if (scene->occluded(point, *shadow_ray, max_dist, object, dt)) {
+                light_count++;
+            }
+        }
+        return light_count;
+    }
+
+    // the direct light reaching a surface given the results of castShadowRays
+    double directLight(Vec3 &normal, Vec3 &shadow_ray, int32 light_count) {
+        // determine an approximate angle of incidence using the last shadow ray cast
+        double d = normal.dot(&shadow_ray);
+        if (d <= 0 || light_count >= SHADOW_RAY_COUNT) {
+            return 0;
+        }
+        return d * 0.2 * (1 - (light_count / (double) SHADOW_RAY_COUNT));
+    }
+
     // Traces a ray and returns a computed color value
-    uint32 traceRay(Vec3 &ray_source, Vec3 &ray, Scene *scene, SceneObject *exclude, int bounce, kdnode *global_tree, kdnode *caustic_tree, Vec3 *light_color) {
+    uint32 traceRay(Vec3 &ray_source, Vec3 &ray, Scene *scene, SceneObject *exclude, int bounce, photon_map *global_map, photon_map *caustic_map, Vec3 *light_color, render_settings *settings, photon_gather *gather, gather_cache *cache) {
         if (bounce > MAX_BOUNCES) {
             return 0xFF000000;
         }
@@ -37,12 +87,13 @@ namespace raytrace {
         Vec3 nearest_normal(0, 0, 0);
         SceneObject *nearest_obj = nullptr;
         scene->intersect(ray_source, ray, exclude, &nearest_result, &nearest_normal, &nearest_obj, randutil::nextDouble());
+        // the ray source is moved along for the secondary rays so we keep how far this hit was
+        double hit_distance = sqrt(nearest_result.distSquared(&ray_source));
         if (nearest_obj == nullptr) {
             // we missed the scene so return a background color
             return 0xFF000000;
-        } else if (nearest_result.y > 4.95 && nearest_result.x > -1 && nearest_result.x < 1 && nearest_result.z > 3 && nearest_result.z < 5) {
+        } else if (hitLight(nearest_result)) {
             // we hit the light source
-            // @TODO: don't hardcode this?
             return (0xFF << 24) | (min(fastfloor(light_color->x * 0xFF) + 50, 0xFF) << 16) | (min(fastfloor(light_color->y * 0xFF) + 50, 0xFF) << 8) | min(fastfloor(light_color->z * 0xFF) + 50, 0xFF);
         } else {
             // we hit some object in the scene
@@ -68,7 +119,7 @@ namespace raytrace {
                 ray_source.set(nearest_result.x + n1.x * 0.01, nearest_result.y + n1.y * 0.01, nearest_result.z + n1.z * 0.01);
                 ray.set(n1.x, n1.y, n1.z);
                 ray.normalize();
-                refract_res = traceRay(ray_source, ray, scene, nullptr, bounce + 1, global_tree, caustic_tree, light_color);
+                refract_res = traceRay(ray_source, ray, scene, nullptr, bounce + 1, global_map, caustic_map, light_color, settings, gather, cache);
             }
             if (nearest_obj->specular_chance > 0) {
                 // calculate reflection angle
@@ -79,88 +130,53 @@ namespace raytrace {
                 ray.set(ray.x - n1.x, ray.y - n1.y, ray.z - n1.z);
                 ray.normalize();
                 // continue trace
-                reflect_res = traceRay(ray_source, ray, scene, nearest_obj, bounce + 1, global_tree, caustic_tree, light_color);
+                reflect_res = traceRay(ray_source, ray, scene, nearest_obj, bounce + 1, global_map, caustic_map, light_color, settings, gather, cache);
             }
             if (nearest_obj->absorb_chance > 0) {
                 // calculate color based on global photon map, caustics, direct lighting, and specular effects
-                photon* nearest_photons[PHOTONS_IN_ESTIMATE];
-                double photon_distances[PHOTONS_IN_ESTIMATE];
-                for (int i = 0; i < PHOTONS_IN_ESTIMATE; i++) {
-                    nearest_photons[i] = nullptr;
-                    photon_distances[i] = 0;
-                }
                 // global illumication
-                double redintensity = 0.0f;
-                double greenintensity = 0.0f;
-                double blueintensity = 0.0f;
-                {
-                    int found = find_nearest_photons(nearest_photons, photon_distances, PHOTONS_IN_ESTIMATE, 0, &nearest_result, global_tree, MAX_PHOTON_RADIUS);
-                    if (nearest_photons[0] != nullptr) {
-                        double r = photon_distances[0];
-                        for (int i = 0; i < found; i++) {
-                            photon *ph = nearest_photons[i];
-                            if (ph == nullptr) {
-                                break;
-                            }
-                            // check the angle of incidence of the photon relative to the surface normal
-                            double d = -nearest_normal.dot(ph->dx, ph->dy, ph->dz);
-                            if (d <= 0) {
-                                continue;
-                            }
-                            // filter out photons that were behind or infront of the surface
-                            // to get better results on parallel edges offset from each other
-                            // where the photon would not actually have a contribution normally
-                            Vec3 dist(nearest_result.x - ph->x, nearest_result.y - ph->y, nearest_result.z - ph->z);
-                            dist.mul((dist.x * nearest_normal.x + dist.y * nearest_normal.y + dist.z * nearest_normal.z) / (dist.z * dist.z + dist.z * dist.z + dist.z * dist.z));
-                            if (dist.lengthSquared() > 0.1) {
-                                continue;
-                            }
-                            // decrease the power of the photon by the square of the distance from
-                            // the sampled point
-                            double filter = (1 - photon_distances[i] / r);
-                            filter = filter * filter;
-                            redintensity += d * (ph->power[0] / 255.0) * filter;
-                            greenintensity += d * (ph->power[1] / 255.0) * filter;
-                            blueintensity += d * (ph->power[2] / 255.0) * filter;
-                        }
-                        // divide the intensities by the area to get a density approximation
-                        redintensity /= (3.141592653589 * 2 * r);
-                        greenintensity /= (3.141592653589 * 2 * r);
-                        blueintensity /= (3.141592653589 * 2 * r);
-                    }
+                double irradiance[3];
+                PhotonIndex *index = global_map->indexes[nearest_obj->index];
+                // hits seen indirectly can make do with a rough estimate from a nearby group of photons
+                bool coarse = settings->coarse_bounce >= 0 && bounce >= settings->coarse_bounce;
+                if (global_map->irradiance != nullptr) {
+                    // the irradiance was precomputed so we only need the nearest estimate
+                    lookupIrradiance(gather, global_map->irradiance[nearest_obj->index], &nearest_result, MAX_PHOTON_RADIUS, irradiance);
+                } else if (!coarse || !index->coarseIrradiance(&nearest_result, &nearest_normal, settings->photons_in_estimate, hit_distance * COARSE_MAX_ANGLE, irradiance)) {
+                    // we only search the photons which landed on the object we hit
+                    estimateIrradiance(gather, cache, index, settings->photons_in_estimate, &nearest_result, &nearest_normal, MAX_PHOTON_RADIUS, irradiance);
                 }
+                double redintensity = irradiance[0];
+                double greenintensity = irradiance[1];
+                double blueintensity = irradiance[2];
                 double redcaustic_contribution = 0;
                 double greencaustic_contribution = 0;
                 double bluecaustic_contribution = 0;
                 { // caustics
-                    int found = find_nearest_photons(nearest_photons, photon_distances, CAUSTIC_PHOTONS_IN_ESTIMATE, 0, &nearest_result, caustic_tree, 100);
-                    if (nearest_photons[0] != nullptr) {
-                        double r = photon_distances[0];
+                    beginGather(gather, settings->caustic_photons_in_estimate);
+                    int found = findNearestCached(cache, gather, &nearest_result, caustic_map->indexes[nearest_obj->index], 100);
+                    if (found > 0) {
+                        double r = gatherRadius(gather);
                         for (int i = 0; i < found; i++) {
-                            photon *ph = nearest_photons[i];
-                            if (ph == nullptr) {
-                                break;
-                            }
+                            photon_payload *ph = gather->payloads[i];
+                            Vec3 direction(0, 0, 0);
+                            photonDirection(ph, &direction);
+                            double power[3];
+                            photonPower(ph, power);
                             // check angle of incidence
-                            double d = -nearest_normal.dot(ph->dx, ph->dy, ph->dz);
+                            double d = -nearest_normal.dot(&direction);
                             if (d <= 0) {
                                 continue;
                             }
-                            // filter photons on a parallel yet offset plane
-                            Vec3 dist(nearest_result.x - ph->x, nearest_result.y - ph->y, nearest_result.z - ph->z);
-                            dist.mul((dist.x * nearest_normal.x + dist.y * nearest_normal.y + dist.z * nearest_normal.z) / (dist.z * dist.z + dist.z * dist.z + dist.z * dist.z));
-                            if (dist.lengthSquared() > 0.1) {
-                                continue;
-                            }
                             // decrease the photons power by the distance raised to the 4th power
                             // so that the caustic photons have a very aggressive falloff
-                            double filter = (1 - photon_distances[i] / r);
+                            double filter = (1 - gather->distances[i] / r);
                             filter = filter * filter * filter * filter;
                             // the photon powers are all shifted towards white so that they still can carry
                             // color if the light was colored but they generally will be a lot lighter
-                            redcaustic_contribution += d * filter * min(ph->power[0] / 255.0f + 0.5, 1);
-                            greencaustic_contribution += d * filter * min(ph->power[1] / 255.0f + 0.5, 1);
-                            bluecaustic_contribution += d * filter * min(ph->power[2] / 255.0f + 0.5, 1);
+                            redcaustic_contribution += d * filter * min(power[0] + 0.5, 1);
+                            greencaustic_contribution += d * filter * min(power[1] + 0.5, 1);
+                            bluecaustic_contribution += d * filter * min(power[2] + 0.5, 1);
                         }
                         // divide by the area as well as an additional factor to account for the
                         // power increase we performed
@@ -171,45 +187,12 @@ namespace raytrace {
                 }
 
                 // calculate direct illumication with a shadow ray
-                int light_count = 0;
-                Vec3 light_source(0, 0, 0);
                 Vec3 shadow_ray(0, 0, 0);
-                Vec3 result(0, 0, 0);
-                Vec3 normal(0, 0, 0);
-                for (int i = 0; i < SHADOW_RAY_COUNT; i++) {
-                    // our light is a square so for each shadow ray we send it towards a random point
-                    // on the light to get a softer shadow
-                    double x0 = randutil::nextDouble() * 2 - 1;
-                    double z0 = randutil::nextDouble() * 2 + 3;
-                    double y0 = 4.95;
-                    light_source.set(x0, y0, z0);
-                    shadow_ray.set(light_source.x - nearest_result.x, light_source.y - nearest_result.y, light_source.z - nearest_result.z);
-                    double max_dist = shadow_ray.lengthSquared();
-                    shadow_ray.normalize();
-                    double dt = randutil::nextDouble();
-                    for (int i = 0; i < scene->size; i++) {
-                        if (scene->objects[i] == nearest_obj) {
-                            continue;
-                        }
-                        if (scene->objects[i]->intersect(&nearest_result, &shadow_ray, &result, &normal, dt)) {
-                            // ensure that the object we hit is in front of the light
-                            if (nearest_result.distSquared(&result) > max_dist) {
-                                continue;
-                            }
-                            // keep track of every ray that hit is in shadow
-                            light_count++;
-                            break;
-                        }
-                    }
-                }
+                int light_count = castShadowRays(scene, nearest_result, nearest_obj, &shadow_ray);
                 double direct = 0;
                 double specular = 0;
                 if (light_count < SHADOW_RAY_COUNT) {
-                    // determine an approximate angle of incidence using the last shadow ray cast
-                    double d = nearest_normal.dot(&shadow_ray);
-                    if (d > 0) {
-                        direct += d * 0.2 * (1 - (light_count / (double) SHADOW_RAY_COUNT));
-                    }
+                    direct = directLight(nearest_normal, shadow_ray, light_count);
                     // calculate any specular effect if at least one shadow ray
                     // reached the light source
                     if (nearest_obj->specular_coeff != 0) {
@@ -259,87 +242,196 @@ namespace raytrace {
         }
     }
 
-    // data used by each job
-    struct render_task_data {
-        int32 y;
+    // data shared by all of the render jobs
+    struct render_context {
         int32 width;
         int32 height;
-        uint32 *pane;
+        render_settings *settings;
+        float *pane;
         Scene *scene;
-        kdnode *global_tree;
-        kdnode *caustic_tree;
+        photon_map *global_map;
+        photon_map *caustic_map;
         Vec3 *light_color;
         Vec3 *camera;
     };
 
-    // renders a row of pixels in the final image
+    // data used by each job
+    struct render_task_data {
+        render_context *context;
+        int32 tile_x;
+        int32 tile_y;
+    };
+
+    // renders a square tile of pixels in the final image, accumulating all of their samples
     void render_task(void *vdata) {
         render_task_data *data = (render_task_data*) vdata;
+        render_context *context = data->context;
+        int32 samples = context->settings->samples;
+        // the photons gathered for each estimate, shared by every trace in this tile
+        int32 k = context->settings->photons_in_estimate;
+        if (context->settings->caustic_photons_in_estimate > k) {
+            k = context->settings->caustic_photons_in_estimate;
+        }
+        photon_gather *gather = createGather(k);
+        // neighbouring pixels and samples land on nearly the same points so they share their photons
+        gather_cache *cache = createGatherCache();
+        // the samples of each pixel fill a grid of cells row by row with the last row left short if the
+        // count isn't a multiple of its width, from "Correlated Multi-Jittered Sampling" by Kensler
+        // each sample is also in its own one of the samples equal strips along both x and y, so both
+        // axes are covered evenly whatever the sample count
+        int32 cols = (int32) ceil(sqrt((double) samples));
+        int32 rows = (samples + cols - 1) / cols;
+        int32 last_row = samples - (rows - 1) * cols;
         Vec3 ray(0, 0, 0);
-        Vec3 ray_source(data->camera);
-        Vec3 *light_dir = new Vec3(0, 0, 0);
-        SceneObject *exclude = nullptr;
-        ray_source.set(0, 0, -12);
-        double last_progress = 0;
-        double fov = (data->width / 1280.0) * 64.0;
-        for (int32 x = 0; x < data->width; x++) {
-            ray_source.set(data->camera);
-            // jitter the ray slightly to reduce artifacts in our anti-aliasing
-            double x1 = randutil::nextDouble() * 0.6 - 0.3;
-            double y1 = randutil::nextDouble() * 0.6 - 0.3;
-            double x0 = (x - data->width / 2 + x1) / fov - ray_source.x;
-            double y0 = (data->y - data->height / 2 + y1) / fov - ray_source.y;
-            ray.set(x0, y0, -ray_source.z);
-            ray.normalize();
-            // @TODO: transform our ray to the final camera position and rotation
-
-            // trace into the scene and set the color into the pane
-            data->pane[x + data->y *data->width] = traceRay(ray_source, ray, data->scene, nullptr, 0, data->global_tree, data->caustic_tree, data->light_color);
+        Vec3 ray_source(context->camera);
+        double fov = (context->width / 1280.0) * 64.0;
+        int32 end_x = min(data->tile_x + TILE_SIZE, context->width);
+        int32 end_y = min(data->tile_y + TILE_SIZE, context->height);
+        for (int32 y = data->tile_y; y < end_y; y++) {
+            for (int32 x = data->tile_x; x < end_x; x++) {
+                float red = 0;
+                float green = 0;
+                float blue = 0;
+                for (int32 sample = 0; sample < samples; sample++) {
+                    // each sample draws from its own stream of random numbers so the image doesn't
+                    // depend on which worker rendered it
+                    randutil::beginStream(randutil::PIXEL_STREAM, x + y * context->width, sample);
+                    int32 row = sample / cols;
+                    int32 col = sample % cols;
+                    // the strip along y is the sample's place going across the rows and the strip along
+                    // x is its place going down the columns, the columns past the last row's end are short
+                    int32 strip_x = col * (rows - 1) + min(col, last_row) + row;
+                    ray_source.set(context->camera);
+                    // jitter the ray within its strips to reduce artifacts in our anti-aliasing
+                    double x1 = (strip_x + randutil::nextDouble()) / samples;
+                    double y1 = (sample + randutil::nextDouble()) / samples;
+                    double x0 = (x - context->width / 2 + x1) / fov - ray_source.x;
+                    double y0 = (y - context->height / 2 + y1) / fov - ray_source.y;
+                    ray.set(x0, y0, -ray_source.z);
+                    ray.normalize();
+                    // @TODO: transform our ray to the final camera position and rotation
+
+                    // trace into the scene and add the color to the pixel
+                    uint32 color = traceRay(ray_source, ray, context->scene, nullptr, 0, context->global_map, context->caustic_map, context->light_color, context->settings, gather, cache);
+                    red += ((color >> 16) & 0xFF) / 255.0f;
+                    green += ((color >> 8) & 0xFF) / 255.0f;
+                    blue += (color & 0xFF) / 255.0f;
+                }
+                float *pixel = &context->pane[(x + y * context->width) * 3];
+                pixel[0] = red / samples;
+                pixel[1] = green / samples;
+                pixel[2] = blue / samples;
+            }
         }
+        deleteGather(gather);
+        deleteGatherCache(cache);
+    }
+
+    // gets every other bit of a morton code, giving one of its coordinates
+    int32 compactMorton(uint32 code) {
+        code &= 0x55555555;
+        code = (code | (code >> 1)) & 0x33333333;
+        code = (code | (code >> 2)) & 0x0F0F0F0F;
+        code = (code | (code >> 4)) & 0x00FF00FF;
+        code = (code | (code >> 8)) & 0x0000FFFF;
+        return (int32) code;
     }
 
-    void renderScene(Scene *scene, Vec3 &camera, uint32 *pane, int32 width, int32 height) {
+    void renderScene(Scene *scene, Vec3 &camera, float *pane, int32 width, int32 height, render_settings *settings) {
         // photon mapping
         // Based on "A Practical Guide to Global Illumination using Photon Maps" from Siggraph 2000
         // https://graphics.stanford.edu/courses/cs348b-00/course8.pdf
 
         Vec3 ray(0, 0, 0);
-        Vec3 light_source(0, 4.96, 4);
         SceneObject *nearest_obj = nullptr;
         Vec3 nearest_result(0, 0, 0);
         Vec3 nearest_normal(0, 0, 0);
         Vec3 light_color(0.6, 0.6, 0.6);
 
-        // calculate the global photon tree
-        kdnode *global_tree = createPhotonMap(NUM_PHOTONS, light_source, light_color, scene);
-        // calculate the caustic photon tree
-        kdnode *caustic_tree = createCausticPhotonMap(CAUSTIC_PHOTONS, light_source, light_color, scene);
+        if (settings->progressive_passes > 0) {
+            renderProgressive(scene, camera, pane, width, height, settings, light_color);
+            return;
+        }
+
+        // calculate the global and caustic photon maps from a single pass of photons
+        photon_map_options options;
+        options.global_backend = settings->global_backend;
+        options.global_k = settings->photons_in_estimate;
+        options.caustic_backend = settings->caustic_backend;
+        options.caustic_k = settings->caustic_photons_in_estimate;
+        options.global_aggregates = settings->coarse_bounce >= 0;
+        photon_map *global_map;
+        photon_map *caustic_map;
+        cachedPhotonMaps(settings->photon_cache, NUM_PHOTONS, CAUSTIC_PHOTONS, light_color, scene, &options, settings->fixed_seed, settings->seed, &global_map, &caustic_map);
+        if (settings->precompute_irradiance) {
+            precomputeIrradiance(global_map, scene, settings->photons_in_estimate, MAX_PHOTON_RADIUS);
+        }
 
         // rendering
         printf("Rendering scene\n");
         auto start = std::chrono::high_resolution_clock::now();
 
-        for (int32 y = 0; y < height; y++) {
-            render_task_data *data = new render_task_data;
-            data->y = y;
-            data->width = width;
-            data->height = height;
-            data->pane = pane;
-            data->scene = scene;
-            data->global_tree = global_tree;
-            data->caustic_tree = caustic_tree;
-            data->light_color = &light_color;
-            data->camera = &camera;
-            scheduler::submit(render_task, data);
+        render_context context;
+        context.width = width;
+        context.height = height;
+        context.settings = settings;
+        context.pane = pane;
+        context.scene = scene;
+        context.global_map = global_map;
+        context.caustic_map = caustic_map;
+        context.light_color = &light_color;
+        context.camera = &camera;
+        // submit the tiles along a morton curve so that tiles near each other in the image are
+        // also rendered near each other in time and share more of the scene and photon maps in cache
+        int32 tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        int32 tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        uint32 curve_size = 1;
+        while (curve_size < (uint32) tiles_x || curve_size < (uint32) tiles_y) {
+            curve_size *= 2;
+        }
+        scheduler::JobGroup group;
+        for (uint32 code = 0; code < curve_size * curve_size; code++) {
+            int32 tx = compactMorton(code);
+            int32 ty = compactMorton(code >> 1);
+            if (tx >= tiles_x || ty >= tiles_y) {
+                continue;
+            }
+            render_task_data data;
+            data.context = &context;
+            data.tile_x = tx * TILE_SIZE;
+            data.tile_y = ty * TILE_SIZE;
+            scheduler::submit(render_task, data, &group);
         }
 
-        scheduler::waitForCompletion();
+        scheduler::wait(&group);
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> duration = end - start;
         printf("Scene rendered in %.3fs\n", duration.count());
 
-        deleteTree(global_tree);
-        deleteTree(caustic_tree);
+        deletePhotonMap(global_map);
+        deletePhotonMap(caustic_map);
+    }
+
+    void defaultSettings(render_settings *settings) {
+        settings->samples = 1;
+        settings->photons_in_estimate = PHOTONS_IN_ESTIMATE;
+        settings->caustic_photons_in_estimate = CAUSTIC_PHOTONS_IN_ESTIMATE;
+        settings->precompute_irradiance = false;
+        settings->global_backend = KD_TREE_BACKEND;
+        settings->caustic_backend = KD_TREE_BACKEND;
+        settings->progressive_passes = 0;
+        settings->photons_per_pass = PHOTONS_PER_PASS;
+        settings->photon_cache = nullptr;
+        settings->coarse_bounce = -1;
+        settings->fixed_seed = false;
+        settings->seed = 0;
+    }
+
+    uint32 paneColor(float *pixel) {
+        int32 red = min(fastfloor(pixel[0] * 0xFF + 0.5), 0xFF);
+        int32 green = min(fastfloor(pixel[1] * 0xFF + 0.5), 0xFF);
+        int32 blue = min(fastfloor(pixel[2] * 0xFF + 0.5), 0xFF);
+        return (0xFF << 24) | (red << 16) | (green << 8) | blue;
     }
 
 }
\ No newline at end of file
@@ -7,6 +7,51 @@
 
 namespace raytrace {
 
-    void renderScene(Scene *scene, Vec3 &camera, uint32 *pane, int32 width, int32 height);
+    // Settings which can be changed for each render
+    struct render_settings {
+        // the number of samples per pixel
+        int32 samples;
+        // the number of photons gathered for each estimate from the global and caustic maps
+        int32 photons_in_estimate;
+        int32 caustic_photons_in_estimate;
+        // whether to precompute the irradiance from the global map so that each diffuse hit
+        // only looks up the nearest estimate
+        bool precompute_irradiance;
+        // the structure used to search the global and caustic maps
+        PhotonBackend global_backend;
+        PhotonBackend caustic_backend;
+        // the number of passes to render with progressive photon mapping, or 0 to render with
+        // the photon maps traced up front
+        int32 progressive_passes;
+        // the number of photons traced for each progressive pass
+        int32 photons_per_pass;
+        // the directory to cache the photon maps in so later renders of the same scene can skip
+        // tracing them, or null to always trace them
+        const char *photon_cache;
+        // diffuse hits this many bounces or more from the camera may estimate the irradiance from the
+        // summed photons of a kd-tree node instead of gathering them, or -1 to always gather them
+        int32 coarse_bounce;
+        // whether to seed the random numbers with seed, otherwise they're seeded from the clock
+        bool fixed_seed;
+        int64 seed;
+    };
+
+    void defaultSettings(render_settings *settings);
+
+    // whether the point is on the light source
+    bool hitLight(Vec3 &point);
+
+    // casts shadow rays from the point towards the light and returns how many of them are in shadow,
+    // the last ray cast is written to shadow_ray
+    int32 castShadowRays(Scene *scene, Vec3 &point, SceneObject *object, Vec3 *shadow_ray);
+
+    // the direct light reaching a surface given the results of castShadowRays
+    double directLight(Vec3 &normal, Vec3 &shadow_ray, int32 light_count);
+
+    // renders the scene into the pane which holds a red, green and blue float for each pixel
+    void renderScene(Scene *scene, Vec3 &camera, float *pane, int32 width, int32 height, render_settings *settings);
+
+    // converts a pixel of the pane to a packed 0xAARRGGBB color
+    uint32 paneColor(float *pixel);
 
 }
\ No newline at end of file
@@ -3,12 +3,25 @@
 
 #include <cmath>
 
+// The farthest distance a ray can travel and hit something
+#define MAX_RAY_DISTANCE 1024
+
 namespace raytrace {
 
+    uint64 hashBytes(uint64 seed, const void *data, size_t size) {
+        const uint8 *bytes = (const uint8*) data;
+        for (size_t i = 0; i < size; i++) {
+            seed ^= bytes[i];
+            seed *= 1099511628211ull;
+        }
+        return seed;
+    }
+
     Scene::Scene(int32 num_objects) {
         size = num_objects;
         objects = new SceneObject*[size];
         for (int i = 0; i < size; i++) objects[i] = nullptr;
+        bvh = nullptr;
     }
 
     Scene::~Scene() {
@@ -18,34 +31,124 @@ namespace raytrace {
             }
         }
         delete[] objects;
+        if (bvh != nullptr) {
+            delete bvh;
+        }
+    }
+
+    void Scene::build() {
+        for (int32 i = 0; i < size; i++) {
+            if (objects[i] != nullptr) {
+                objects[i]->index = i;
+            }
+        }
+        if (bvh != nullptr) {
+            delete bvh;
+        }
+        bvh = new BVH(objects, size);
     }
 
     // intersects with all objects in the scene (except the given excluded object if its not null)
     // returns the point hit and the surface normal
     void Scene::intersect(Vec3 &ray_source, Vec3 &ray, SceneObject *exclude, Vec3 *final_result, Vec3 *result_normal, SceneObject **hit_object, double dt) {
-        double nearest = 1024 * 1024;
+        // each object only reports a hit if it is nearer than our current nearest hit, so far
+        // objects bail out early and we only compute the hit point and normal once at the end
+        double nearest = MAX_RAY_DISTANCE;
         SceneObject *nearest_obj = nullptr;
-        Vec3 result(0, 0, 0);
-        Vec3 normal(0, 0, 0);
-        for (int i = 0; i < size; i++) {
-            if (objects[i] == exclude) {
+        // our rays are always normalized so distances along the ray are the same as distances in the scene
+        double origin[3] = {ray_source.x, ray_source.y, ray_source.z};
+        double inv_ray[3] = {1 / ray.x, 1 / ray.y, 1 / ray.z};
+        int32 stack[BVH_STACK_SIZE];
+        int32 stack_size = 0;
+        if (bvh->node_count > 0) {
+            stack[stack_size++] = 0;
+        }
+        while (stack_size > 0) {
+            bvhnode *node = &bvh->nodes[stack[--stack_size]];
+            // skip any node that the ray only enters after our nearest hit
+            if (!intersectBounds(node, origin, inv_ray, nearest)) {
+                continue;
+            }
+            if (node->count == 0) {
+                // visit the nearer child first so that its hits can cull the farther child
+                int32 left = (int32) (node - bvh->nodes) + 1;
+                if (inv_ray[node->splitting_axis] < 0) {
+                    stack[stack_size++] = left;
+                    stack[stack_size++] = node->offset;
+                } else {
+                    stack[stack_size++] = node->offset;
+                    stack[stack_size++] = left;
+                }
                 continue;
             }
-            if (objects[i]->intersect(&ray_source, &ray, &result, &normal, dt)) {
-                double dist = (result.x - ray_source.x) * (result.x - ray_source.x);
-                dist += (result.y - ray_source.y) * (result.y - ray_source.y);
-                dist += (result.z - ray_source.z) * (result.z - ray_source.z);
-                if (dist < nearest) {
-                    nearest = dist;
-                    nearest_obj = objects[i];
-                    final_result->set(result.x, result.y, result.z);
-                    result_normal->set(normal.x, normal.y, normal.z);
+            for (int32 i = node->offset; i < node->offset + node->count; i++) {
+                SceneObject *obj = bvh->objects[i];
+                if (obj != exclude && obj->intersect(&ray_source, &ray, &nearest, dt)) {
+                    nearest_obj = obj;
                 }
             }
         }
+        if (nearest_obj != nullptr) {
+            final_result->set(ray.x * nearest + ray_source.x, ray.y * nearest + ray_source.y, ray.z * nearest + ray_source.z);
+            nearest_obj->normal(final_result, result_normal, dt);
+        }
         *hit_object = nearest_obj;
     }
 
+    // checks if any object in the scene (except the excluded object) blocks the ray before max_dist
+    // stops at the first blocker found rather than searching for the nearest
+    bool Scene::occluded(Vec3 &ray_source, Vec3 &ray, double max_dist, SceneObject *exclude, double dt) {
+        double origin[3] = {ray_source.x, ray_source.y, ray_source.z};
+        double inv_ray[3] = {1 / ray.x, 1 / ray.y, 1 / ray.z};
+        int32 stack[BVH_STACK_SIZE];
+        int32 stack_size = 0;
+        if (bvh->node_count > 0) {
+            stack[stack_size++] = 0;
+        }
+        while (stack_size > 0) {
+            bvhnode *node = &bvh->nodes[stack[--stack_size]];
+            if (!intersectBounds(node, origin, inv_ray, max_dist)) {
+                continue;
+            }
+            if (node->count == 0) {
+                stack[stack_size++] = node->offset;
+                stack[stack_size++] = (int32) (node - bvh->nodes) + 1;
+                continue;
+            }
+            for (int32 i = node->offset; i < node->offset + node->count; i++) {
+                SceneObject *obj = bvh->objects[i];
+                double t = max_dist;
+                if (obj != exclude && obj->intersect(&ray_source, &ray, &t, dt)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    uint64 Scene::hash() {
+        uint64 result = hashBytes(14695981039346656037ull, &size, sizeof(size));
+        for (int32 i = 0; i < size; i++) {
+            // empty slots still change which index the following objects get
+            if (objects[i] == nullptr) {
+                result = hashBytes(result, &i, sizeof(i));
+            } else {
+                result = objects[i]->hash(result);
+            }
+        }
+        return result;
+    }
+
+    uint64 SceneObject::hashMaterial(uint64 seed) {
+        // the fields are hashed one at a time so padding between them doesn't leak in
+        double position[3] = { x, y, z };
+        float color[3] = { red, green, blue };
+        double material[6] = { absorb_chance, diffuse_chance, specular_chance, transmission_chance, refraction, specular_coeff };
+        seed = hashBytes(seed, position, sizeof(position));
+        seed = hashBytes(seed, color, sizeof(color));
+        return hashBytes(seed, material, sizeof(material));
+    }
+
     SphereObject::SphereObject(double x0, double y0, double z0, double r0, uint32 col, double d, double s, double t, double a) {
         x = x0;
         y = y0;
@@ -84,37 +187,54 @@ namespace raytrace {
         dz = dz0;
     }
 
-    bool SphereObject::intersect(Vec3 *ray_source, Vec3 *ray, Vec3 *result, Vec3 *result_normal, double dt) {
+    bool SphereObject::intersect(Vec3 *ray_source, Vec3 *ray, double *t, double dt) {
         // A geometric intersection solution
         // described here: https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
         double x0 = x + dt * dx;
         double y0 = y + dt * dy;
         double z0 = z + dt * dz;
         // check that we're casting in the right direction
-        Vec3 l(x0 - ray_source->x, y0 - ray_source->y, z0 - ray_source->z);
-        double b = ray->dot(&l);
+        double lx = x0 - ray_source->x;
+        double ly = y0 - ray_source->y;
+        double lz = z0 - ray_source->z;
+        double b = ray->dot(lx, ly, lz);
         if (b < 0) {
             return false;
         }
-        double d2 = l.dot(&l) - b  * b;
-        if (d2 > radius * radius) {
+        // if even the closest point on the sphere is past our current nearest hit then we can stop
+        if (b - radius > *t) {
             return false;
         }
-        double t = std::sqrt(radius * radius - d2);
-        if (t < 0) {
-            t = b + t;
-        } else {
-            t = b - t;
+        double d2 = lx * lx + ly * ly + lz * lz - b * b;
+        if (d2 > radius * radius) {
+            return false;
         }
-        if (t < 0) {
+        double hit = b - std::sqrt(radius * radius - d2);
+        if (hit < 0 || hit >= *t) {
             return false;
         }
-        result->set(ray->x * t + ray_source->x, ray->y * t + ray_source->y, ray->z * t + ray_source->z);
-        result_normal->set(result->x - x0, result->y - y0, result->z - z0);
-        result_normal->normalize();
+        *t = hit;
         return true;
     }
 
+    void SphereObject::normal(Vec3 *point, Vec3 *result_normal, double dt) {
+        result_normal->set(point->x - (x + dt * dx), point->y - (y + dt * dy), point->z - (z + dt * dz));
+        result_normal->normalize();
+    }
+
+    void SphereObject::bounds(Vec3 *min, Vec3 *max) {
+        // the sphere moves from its origin to origin + d over the course of a frame
+        min->set(std::fmin(x, x + dx) - radius, std::fmin(y, y + dy) - radius, std::fmin(z, z + dz) - radius);
+        max->set(std::fmax(x, x + dx) + radius, std::fmax(y, y + dy) + radius, std::fmax(z, z + dz) + radius);
+    }
+
+    uint64 SphereObject::hash(uint64 seed) {
+        double shape[4] = { radius, dx, dy, dz };
+        seed = hashBytes(seed, "sphere", 6);
+        seed = hashMaterial(seed);
+        return hashBytes(seed, shape, sizeof(shape));
+    }
+
     PlaneObject::PlaneObject(double x0, double y0, double z0, double min, double max, uint32 col, double d, double s, double t, double a) {
         x = x0;
         y = y0;
@@ -132,12 +252,12 @@ namespace raytrace {
         specular_coeff = 0;
     }
 
-    bool PlaneObject::intersect(Vec3 *camera, Vec3 *ray, Vec3 *result, Vec3 *normal, double dt) {
+    bool PlaneObject::intersect(Vec3 *camera, Vec3 *ray, double *t, double) {
+        // our rays are normalized so the multiple of the ray needed to reach the plane is also the distance to it
         if (x != 0) {
             // find the distance from the source to the plane in the normal of the plane
-            double dx = x - camera->x;
-            double mul = dx / ray->x;
-            if (mul < 0) {
+            double mul = (x - camera->x) / ray->x;
+            if (mul < 0 || mul >= *t) {
                 return false;
             }
             // find the distance traveled in the other two dimensions to
@@ -151,13 +271,11 @@ namespace raytrace {
             if (hy > max_bound || hy < min_bound) {
                 return false;
             }
-            result->set(x, hy, hz);
-            normal->set(x < 0 ? 1 : -1, 0, 0);
+            *t = mul;
             return true;
         } else if (y != 0) {
-            double dy = y - camera->y;
-            double mul = dy / ray->y;
-            if (mul < 0) {
+            double mul = (y - camera->y) / ray->y;
+            if (mul < 0 || mul >= *t) {
                 return false;
             }
             double hz = camera->z + mul * ray->z;
@@ -168,13 +286,11 @@ namespace raytrace {
             if (hx < min_bound || hx > max_bound) {
                 return false;
             }
-            result->set(hx, y, hz);
-            normal->set(0, y < 0 ? 1 : -1, 0);
+            *t = mul;
             return true;
         } else if (z > 0) {
-            double dz = z - camera->z;
-            double mul = dz / ray->z;
-            if (mul < 0) {
+            double mul = (z - camera->z) / ray->z;
+            if (mul < 0 || mul >= *t) {
                 return false;
             }
             double hx = camera->x + mul * ray->x;
@@ -185,10 +301,45 @@ namespace raytrace {
             if (hy < min_bound || hy > max_bound) {
                 return false;
             }
-            result->set(hx, hy, z);
-            normal->set(0, 0, z < 0 ? 1 : -1);
+            *t = mul;
             return true;
         }
         return false;
     }
+
+    void PlaneObject::normal(Vec3 *, Vec3 *result_normal, double) {
+        if (x != 0) {
+            result_normal->set(x < 0 ? 1 : -1, 0, 0);
+        } else if (y != 0) {
+            result_normal->set(0, y < 0 ? 1 : -1, 0);
+        } else {
+            result_normal->set(0, 0, z < 0 ? 1 : -1);
+        }
+    }
+
+    void PlaneObject::bounds(Vec3 *min, Vec3 *max) {
+        // mirrors the bounds checks in intersect, the side walls are open towards the camera
+        // so they extend out as far as a ray can reach
+        if (x != 0) {
+            min->set(x, min_bound, -0.01);
+            max->set(x, max_bound, MAX_RAY_DISTANCE);
+        } else if (y != 0) {
+            min->set(min_bound, y, -0.01);
+            max->set(max_bound, y, MAX_RAY_DISTANCE);
+        } else if (z > 0) {
+            min->set(-5, min_bound, z);
+            max->set(5, max_bound, z);
+        } else {
+            // this plane can never be hit
+            min->set(x, y, z);
+            max->set(x, y, z);
+        }
+    }
+
+    uint64 PlaneObject::hash(uint64 seed) {
+        double shape[2] = { min_bound, max_bound };
+        seed = hashBytes(seed, "plane", 5);
+        seed = hashMaterial(seed);
+        return hashBytes(seed, shape, sizeof(shape));
+    }
 }
\ No newline at end of file
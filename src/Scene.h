@@ -1,14 +1,31 @@
 #pragma once
 
+#include <cstddef>
+
 #include "Vector.h"
+#include "BVH.h"
 
 namespace raytrace {
 
+    // hashes the bytes into the seed with 64 bit FNV-1a
+    uint64 hashBytes(uint64 seed, const void *data, size_t size);
+
     // An abstract class for an object in the scene
     class SceneObject {
     public:
 
-        virtual bool intersect(Vec3 *ray_source, Vec3 *ray, Vec3 *result, Vec3 *result_normal, double dt) = 0;
+        // intersects the ray with the object, t holds the distance to the nearest hit so far and a
+        // hit is only reported (and t updated) if it is nearer than that
+        virtual bool intersect(Vec3 *ray_source, Vec3 *ray, double *t, double dt) = 0;
+        // gets the surface normal at a point on the object
+        virtual void normal(Vec3 *point, Vec3 *result_normal, double dt) = 0;
+        // gets the axis aligned bounds of the object over its entire motion
+        virtual void bounds(Vec3 *min, Vec3 *max) = 0;
+        // hashes everything about the object that changes how it's rendered into the seed
+        virtual uint64 hash(uint64 seed) = 0;
+
+        // hashes the position and material shared by every kind of object into the seed
+        uint64 hashMaterial(uint64 seed);
 
         double x, y, z;
         float red, green, blue;
@@ -19,6 +36,9 @@ namespace raytrace {
         double transmission_chance;
         double refraction;
         double specular_coeff;
+
+        // the position of the object in its scene's objects, set when the scene is built
+        int32 index;
     };
 
     class Scene {
@@ -28,8 +48,14 @@ namespace raytrace {
 
         int32 size;
         SceneObject **objects;
+        BVH *bvh;
 
+        // builds the acceleration structure, must be called after the objects are set up and before any intersections
+        void build();
         void intersect(Vec3 &ray_source, Vec3 &ray, SceneObject *exclude, Vec3 *result, Vec3 *result_normal, SceneObject **hit_object, double dt);
+        bool occluded(Vec3 &ray_source, Vec3 &ray, double max_dist, SceneObject *exclude, double dt);
+        // hashes the objects so that scenes with the same contents have the same hash
+        uint64 hash();
 
     };
 
@@ -39,7 +65,10 @@ namespace raytrace {
         SphereObject(double x0, double y0, double z0, double r0, uint32 col, double d, double s, double t, double a);
         SphereObject(double x0, double y0, double z0, double r0, uint32 col, double d, double s, double t, double a, double dx, double dy, double dz);
 
-        bool intersect(Vec3 *ray_source, Vec3 *ray, Vec3 *result, Vec3 *result_normal, double dt) override;
+        bool intersect(Vec3 *ray_source, Vec3 *ray, double *t, double dt) override;
+        void normal(Vec3 *point, Vec3 *result_normal, double dt) override;
+        void bounds(Vec3 *min, Vec3 *max) override;
+        uint64 hash(uint64 seed) override;
 
         double radius;
         double dx, dy, dz;
@@ -51,7 +80,10 @@ namespace raytrace {
         // x0,y0,z0 should form a unit vector in the axis of the plane, arbitrary planes not supported
         PlaneObject(double x0, double y0, double z0, double min, double max, uint32 col, double d, double s, double t, double a);
 
-        bool intersect(Vec3 *camera, Vec3 *ray, Vec3 *result, Vec3 *normal, double dt) override;
+        bool intersect(Vec3 *camera, Vec3 *ray, double *t, double dt) override;
+        void normal(Vec3 *point, Vec3 *result_normal, double dt) override;
+        void bounds(Vec3 *min, Vec3 *max) override;
+        uint64 hash(uint64 seed) override;
 
         double min_bound;
         double max_bound;